@@ -9,59 +9,528 @@ extern "C" {
 #include "qemu-plugin.h"
 }
 
+#include <errno.h>
 #include <glib.h>
+#include <linux/perf_event.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <mutex>
-#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "blocks.h"
+#include "codec.h"
+#include "format.h"
+#include "projection.h"
+#include "reader.h"
+#include "stats.h"
+#include "trace.h"
+#include "writer.h"
 
 /* Physical memory start address of Proxy Kernel */
 #ifndef MEM_START
 #define MEM_START 0x80000000
 #endif
 
+/*
+ * QEMU 9.0 (plugin API v2) replaced inline operations on shared pointers
+ * with per-vCPU scoreboards, and QEMU 9.1 (v3) can fire a callback only
+ * when an inline counter satisfies a condition.
+ */
+#if QEMU_PLUGIN_VERSION >= 2
+#define HAS_SCOREBOARD 1
+#else
+#define HAS_SCOREBOARD 0
+#endif
+
+#if QEMU_PLUGIN_VERSION >= 3
+#define HAS_COND_CB 1
+#else
+#define HAS_COND_CB 0
+#endif
+
+/* Number of block counters allocated at once */
+#define COUNTER_CHUNK 1024
+
+/*
+ * Number of blocks sharing a dirty counter. Each chunk stores its dirty
+ * counters right after the block counters.
+ */
+#define DIRTY_GROUP 64
+#define CHUNK_GROUPS (COUNTER_CHUNK / DIRTY_GROUP)
+#define CHUNK_SIZE (COUNTER_CHUNK + CHUNK_GROUPS)
+
+/* Initial number of slots in the block table, must be a power of two */
+#define HOTBLOCKS_INIT_SIZE 16384
+
+/*
+ * Bits of the instruction count in ids of ids=pc, above the TB size limit
+ * of QEMU. The pc takes the others.
+ */
+#define PC_ID_INSNS_BITS 10
+
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
+/*
+ * Inline Counters
+ *
+ * With scoreboards every vCPU increments its own copy of a counter, so
+ * SMP guests neither lose counts nor bounce cache lines between host cores.
+ * Older QEMU can only add to a shared location.
+ */
+#if HAS_SCOREBOARD
+typedef qemu_plugin_u64 Counter;
+typedef struct qemu_plugin_scoreboard *CounterChunk;
+
+static inline Counter new_counter() {
+  return qemu_plugin_scoreboard_u64(
+      qemu_plugin_scoreboard_new(sizeof(uint64_t)));
+}
+
+static inline CounterChunk new_counter_chunk() {
+  return qemu_plugin_scoreboard_new(sizeof(uint64_t) * CHUNK_SIZE);
+}
+
+static inline Counter counter_in_chunk(CounterChunk chunk, size_t index) {
+  return {chunk, sizeof(uint64_t) * index};
+}
+
+static inline uint64_t get_counter(Counter cnt) {
+  return qemu_plugin_u64_sum(cnt);
+}
+
+static inline void clear_counter(Counter cnt) {
+  for (int i = 0; i < qemu_plugin_num_vcpus(); ++i) {
+    qemu_plugin_u64_set(cnt, i, 0);
+  }
+}
+
+static inline uint64_t get_vcpu_counter(Counter cnt, unsigned int vcpu) {
+  return qemu_plugin_u64_get(cnt, vcpu);
+}
+
+static inline void clear_vcpu_counter(Counter cnt, unsigned int vcpu) {
+  qemu_plugin_u64_set(cnt, vcpu, 0);
+}
+
+static inline void register_inline_add(struct qemu_plugin_tb *tb, Counter cnt,
+                                       uint64_t value = 1) {
+  qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+      tb, QEMU_PLUGIN_INLINE_ADD_U64, cnt, value);
+}
+
+static inline int num_counter_copies() { return qemu_plugin_num_vcpus(); }
+
+static inline uint64_t *counter_chunk_data(CounterChunk chunk, int copy) {
+  return reinterpret_cast<uint64_t *>(
+      qemu_plugin_scoreboard_find(chunk, copy));
+}
+#else
+typedef uint64_t *Counter;
+typedef uint64_t *CounterChunk;
+
+static inline Counter new_counter() { return g_new0(uint64_t, 1); }
+
+static inline CounterChunk new_counter_chunk() {
+  return g_new0(uint64_t, CHUNK_SIZE);
+}
+
+static inline Counter counter_in_chunk(CounterChunk chunk, size_t index) {
+  return chunk + index;
+}
+
+static inline uint64_t get_counter(Counter cnt) { return *cnt; }
+
+static inline void clear_counter(Counter cnt) { *cnt = 0; }
+
+static inline uint64_t get_vcpu_counter(Counter cnt, unsigned int vcpu) {
+  return *cnt;
+}
+
+static inline void clear_vcpu_counter(Counter cnt, unsigned int vcpu) {
+  *cnt = 0;
+}
+
+static inline void register_inline_add(struct qemu_plugin_tb *tb, Counter cnt,
+                                       uint64_t value = 1) {
+  qemu_plugin_register_vcpu_tb_exec_inline(tb, QEMU_PLUGIN_INLINE_ADD_U64,
+                                           cnt, value);
+}
+
+static inline int num_counter_copies() { return 1; }
+
+static inline uint64_t *counter_chunk_data(CounterChunk chunk, int copy) {
+  return chunk;
+}
+#endif
+
+/*
+ * Sum up all copies of the counters in the dirty groups of a chunk, and
+ * reset them. Returns a bit mask of the dirty groups, entries of sum in
+ * other groups are left untouched. Groups that no block executed in since
+ * the last call are skipped, so only executed groups are summed. Every
+ * dirty counter is still checked, in each copy, so a dump also costs
+ * blocks / DIRTY_GROUP checks per vCPU, on top of an inline add per TB.
+ */
+static uint32_t collect_counter_chunk(CounterChunk chunk, uint64_t *sum) {
+  static_assert(CHUNK_GROUPS <= 32, "too many groups in a chunk");
+  uint32_t dirty = 0;
+  for (int i = 0; i < num_counter_copies(); ++i) {
+    auto data = counter_chunk_data(chunk, i);
+    auto dirty_count = data + COUNTER_CHUNK;
+    for (size_t j = 0; j < CHUNK_GROUPS; ++j) {
+      if (!dirty_count[j]) continue;
+      auto group = data + j * DIRTY_GROUP;
+      auto group_sum = sum + j * DIRTY_GROUP;
+      if (dirty & (1u << j)) {
+        for (size_t k = 0; k < DIRTY_GROUP; ++k) group_sum[k] += group[k];
+      } else {
+        memcpy(group_sum, group, sizeof(uint64_t) * DIRTY_GROUP);
+        dirty |= 1u << j;
+      }
+      memset(group, 0, sizeof(uint64_t) * DIRTY_GROUP);
+      dirty_count[j] = 0;
+    }
+  }
+  return dirty;
+}
+
 /* Command line arguments */
 static uint64_t ckpt_func_start, ckpt_func_len;
+static uint64_t interval_len = 0; /* fixed interval length, 0 if disabled */
+static std::vector<uint64_t> coarse_lens; /* coarser interval lengths */
+static CodecOptions codec_options = {CODEC_GZIP, CODEC_DEFAULT_LEVEL,
+                                     Z_DEFAULT_STRATEGY, false, 1};
+static BbvFormat bbv_format = FORMAT_TEXT;
+static unsigned project_dims = 0; /* dimensions of projection, 0 if disabled */
+static bool project_only = false;  /* write projected vectors only */
 
 /* Plugins need to take care of their own locking */
 static std::mutex lock;
-static GHashTable *hotblocks;
+static std::string stats_file_name; /* JSON statistics, stderr if empty */
+static std::string blocks_file_name; /* block dictionary, none if empty */
+
+/* Block counters and instruction counts, indexed by TB id - 1 */
+static std::vector<CounterChunk> counter_chunks;
+static std::vector<uint32_t> block_insns;
+static uint64_t chunk_exec_count[COUNTER_CHUNK]; /* used by dump_bbv */
 
 static uint64_t unique_trans_id = 0; /* unique id assigned to TB */
-static uint64_t ckpt_exec_num = 0; /* number of times ckpt func was executed */
+
+/*
+ * Ids written out, in translation order by default. ids=pc derives them
+ * from the pc and size of blocks, and ids=dict from a dictionary kept
+ * across runs, so they do not depend on the order of translation.
+ * Counters are still indexed by TB id.
+ */
+enum IdScheme {
+  IDS_ORDER,
+  IDS_PC,
+  IDS_DICT,
+};
+static IdScheme id_scheme = IDS_ORDER;
+static std::vector<uint64_t> stable_ids; /* indexed by TB id - 1 */
+/* ids of ids=dict by pc and size, including blocks of earlier runs */
+static std::map<std::pair<uint64_t, uint64_t>, uint64_t> dict_ids;
+static uint64_t dict_max_id = 0;
+/* entries of an interval with stable ids, sorted before being written */
+static std::vector<std::pair<uint64_t, uint64_t>> stable_entries;
+#if HAS_COND_CB
+static Counter ckpt_exec_num; /* number of times ckpt func was executed */
+#else
+static Counter user_exec_num; /* user TBs executed since last checkpoint */
+#endif
+static Counter insn_count; /* user instructions executed in this interval */
 
 static bool is_first_ckpt = true;
+static uint64_t interval_num = 0; /* index of the next interval */
+
+/*
+ * Fast-forwarding
+ *
+ * Before start_interval, only interval boundaries are found: checkpoints
+ * by a callback on the entry of the checkpoint function, or instructions
+ * as usual. Once the start is reached, the plugin is reset, which removes
+ * all instrumentation and flushes TBs, and blocks are counted from the TBs
+ * translated again. Emulation ends after end_interval.
+ */
+static qemu_plugin_id_t plugin_id;
+static uint64_t start_interval = 0;
+static uint64_t end_interval = 0; /* first interval not written, 0 if none */
+static bool skipping = false;     /* before start_interval */
+static bool start_requested = false;
+static uint64_t skipped_ckpts = 0;
+static unsigned int reset_vcpu; /* vCPU that reached the start */
+
+static BbvWriter *bbv_writer; /* null if only projecting */
+static IntervalEncoder bbv_encoder(FORMAT_TEXT);
+
+/* Random projection of intervals, see projection.h */
+static BbvWriter *proj_writer; /* null if projection is disabled */
+static Projection *projection;
+static std::vector<double> proj_sum; /* projection of the current interval */
+static std::vector<float> proj_vec;
+
+/*
+ * Online Phase Detection
+ *
+ * Projected intervals are clustered as they are dumped by leader-follower:
+ * an interval joins the phase with the nearest center if it is within the
+ * threshold, and moves the center towards it, or starts a new phase.
+ */
+static double phase_threshold = 0; /* distance threshold, 0 if disabled */
+static uint64_t stop_after_stable = 0; /* 0 if never stopping early */
+static BbvWriter *phase_writer;
+static std::vector<float> phase_centers; /* project_dims floats each */
+static std::vector<uint64_t> phase_sizes;
+static uint64_t stable_intervals = 0; /* intervals since the last new phase */
+static bool stop_requested = false;
+
+/*
+ * Output of a coarser interval length. Coarse intervals are built by
+ * summing up the vectors of the finest intervals, so no extra counters are
+ * updated while emulating.
+ */
+struct CoarseStream {
+  uint64_t ratio;   /* number of finest intervals in a coarse one */
+  uint64_t pending; /* finest intervals summed up so far */
+  uint64_t interval_num;
+  BbvWriter *writer;
+  IntervalEncoder encoder;
+  std::vector<uint64_t> sum; /* indexed by TB id - 1 */
+  std::vector<uint32_t> ids; /* indices of non-zero entries of sum */
+};
 
-static gzFile bbv_file;
+static std::vector<CoarseStream> coarse_streams;
+
+/*
+ * Host Performance Counters
+ *
+ * Host cycles, instructions, cache misses and branch misses of QEMU are
+ * counted per thread by perf_event_open, from the first TB each thread
+ * translates, and in the threads of the plugin writing and compressing
+ * output, and sampled whenever an interval ends. In the baseline mode
+ * blocks are not counted, only interval boundaries are found, so the share
+ * of the plugin is the difference from a run counting them.
+ */
+enum PerfMode {
+  PERF_OFF,
+  PERF_COUNT,
+  PERF_BASELINE,
+};
+
+#define PERF_EVENTS 4
+
+static PerfMode perf_mode = PERF_OFF;
+static BbvWriter *perf_writer;
+static std::vector<int> perf_groups; /* group leaders of all threads */
+static thread_local bool perf_opened = false;
+static uint64_t perf_last[PERF_EVENTS]; /* sums at the last sample */
+
+static void open_thread_perf();
+
+/*
+ * Block Sampling
+ *
+ * With sample=N, user TBs only bump a per-vCPU count, and the block that
+ * ends a period of about N TBs is credited with the whole period. Periods
+ * are random between N/2 and 3N/2, so loops do not alias with them. A
+ * period running at an interval boundary is credited entirely to the
+ * later interval, which biases the estimate towards the blocks that start
+ * an interval. Block counters are then written by the sampling callback,
+ * and the inline adds to scattered counters are left out. A conditional
+ * callback is needed to keep the check inline.
+ */
+static uint64_t sample_period = 0; /* TBs per sample, 0 for exact counts */
+
+#if HAS_COND_CB
+struct SampleState {
+  uint64_t count; /* TBs executed, up to the threshold of 2N */
+  uint64_t start; /* count at the start of the period */
+  uint64_t rng;
+};
+
+static struct qemu_plugin_scoreboard *sample_states;
+static Counter sample_count;
+#endif
+
+/*
+ * Confidence of the estimated BBVs. Samples alternate between two halves,
+ * and the distance between the vectors of the halves tells how far the
+ * estimate is from the exact vector.
+ */
+static std::vector<uint64_t> half_count; /* second half, indexed by id - 1 */
+static uint64_t half_insns[2];           /* instructions of each half */
+static uint64_t interval_samples = 0;    /* samples in the current interval */
+static uint64_t total_samples = 0;
+static uint64_t sampled_intervals = 0;
+static double sample_error_sum = 0; /* estimated errors of all intervals */
+
+/*
+ * Trace Capture
+ *
+ * Every vCPU encodes the blocks it executes into its own buffer without
+ * locking, which is handed to the trace writer once it is large enough.
+ * Block definitions are collected at translation time, and written before
+ * the next buffer, so they always precede the first execution.
+ *
+ * At every interval boundary, the buffers of all vCPUs are written, that
+ * of the vCPU ending the interval last, so blocks counted in an interval
+ * precede its boundary in the trace under SMP as well.
+ */
+#define TRACE_FLUSH_SIZE (1024 * 1024)
+
+/*
+ * Records of a vCPU, appended without the plugin lock. Its own mutex is
+ * only contended at exit, when another vCPU may flush it, and is never
+ * held while taking the plugin lock.
+ */
+struct TraceBuffer {
+  std::mutex mutex;
+  std::string buf;
+  std::string full; /* taken from buf, written once the lock is held */
+  TraceEncoder encoder;
+  bool closed = false;
+};
+
+static BbvWriter *trace_writer; /* null if tracing is disabled */
+static std::string trace_defs;  /* block definitions not written yet */
+static TraceBuffer *trace_buffers[TRACE_MAX_VCPUS];
 
 /*
  * Counting Structure
  *
  * The internals of the TCG are not exposed to plugins so we can only
- * get the starting PC for each block. We cheat this slightly by
- * xor'ing the number of instructions to the hash to help
- * differentiate.
+ * get the starting PC for each block. Blocks are told apart by the
+ * starting PC together with the number of instructions.
+ *
+ * Records are stored inline in an open-addressing table with linear
+ * probing. Slots with a zero id are empty, since ids start from one.
+ * The table is only used at translation time, the counters themselves
+ * live in counter_chunks.
  */
 struct ExecCount {
-  uint64_t id;
+  uint64_t pc;
   uint64_t insns;
-  uint64_t exec_count;
+  uint64_t id;
 };
 
+static std::vector<ExecCount> hotblocks;
+static size_t hotblocks_num = 0; /* number of occupied slots */
+
+static size_t hash_block(uint64_t pc, uint64_t insns) {
+  /* finalizer of MurmurHash3, TB sizes are far below 2^16 */
+  uint64_t h = pc ^ (insns << 48);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/* lock required for this function */
+static ExecCount *find_block(uint64_t pc, uint64_t insns) {
+  size_t mask = hotblocks.size() - 1;
+  for (size_t i = hash_block(pc, insns) & mask;; i = (i + 1) & mask) {
+    auto &rec = hotblocks[i];
+    if (!rec.id || (rec.pc == pc && rec.insns == insns)) return &rec;
+  }
+}
+
+/* lock required for this function */
+static void grow_hotblocks() {
+  std::vector<ExecCount> old(hotblocks.size() * 2);
+  old.swap(hotblocks);
+  for (const auto &rec : old) {
+    if (rec.id) *find_block(rec.pc, rec.insns) = rec;
+  }
+}
+
+/* Id written out for the counter at index, which is TB id - 1 */
+static inline uint64_t written_id(size_t index) {
+  return id_scheme == IDS_ORDER ? index + 1 : stable_ids[index];
+}
+
+/* lock required for this function */
+static uint64_t stable_block_id(uint64_t pc, uint64_t insns) {
+  if (id_scheme == IDS_PC) return pc << PC_ID_INSNS_BITS | insns;
+  auto result = dict_ids.insert({{pc, insns}, dict_max_id + 1});
+  if (result.second) dict_max_id++;
+  return result.first->second;
+}
+
 static void show_usage() {
   std::cerr << "Available options:" << std::endl;
   std::cerr << "  ckpt_start=<checkpoint func start>" << std::endl;
   std::cerr << "  ckpt_len=<checkpoint func len>" << std::endl;
+  std::cerr << "  or interval=<interval length in instructions>[:<length>...]"
+            << std::endl;
   std::cerr << "  [bbv_file=<BBV file name>]" << std::endl;
+  std::cerr << "  [format=text|binary]" << std::endl;
+  std::cerr << "  [codec=gzip|zstd|lz4|none]" << std::endl;
+  std::cerr << "  [level=<compression level>]" << std::endl;
+  std::cerr << "  [strategy=default|filtered|huffman|rle|fixed]" << std::endl;
+  std::cerr << "  [long=<enable zstd long distance matching>]" << std::endl;
+  std::cerr << "  [compress_threads=<gzip compression threads>]" << std::endl;
+  std::cerr << "  [trace_file=<block trace file name>]" << std::endl;
+  std::cerr << "  [project=<dimensions of projected vectors>]" << std::endl;
+  std::cerr << "  [proj_file=<projected vector file name>]" << std::endl;
+  std::cerr << "  [project_only=<only write projected vectors>]" << std::endl;
+  std::cerr << "  [phases=<phase distance threshold>]" << std::endl;
+  std::cerr << "  [phase_file=<phase file name>]" << std::endl;
+  std::cerr << "  [stop_after_stable=<intervals without new phases>]"
+            << std::endl;
+  std::cerr << "  [start_interval=<first interval written>]" << std::endl;
+  std::cerr << "  [end_interval=<interval to stop emulation at>]"
+            << std::endl;
+  std::cerr << "  [sample=<TBs per sample, estimating BBVs>]" << std::endl;
+  std::cerr << "  [perf=off|count|baseline]" << std::endl;
+  std::cerr << "  [perf_file=<host performance counter file name>]"
+            << std::endl;
+  std::cerr << "  [stats_file=<statistics file name, STATS=1 builds only>]"
+            << std::endl;
+  std::cerr << "  [blocks_file=<block dictionary file name>]" << std::endl;
+  std::cerr << "  [ids=order|pc|dict]" << std::endl;
 }
 
-static bool parse_args(int argc, char **argv, std::string &bbv_file_name) {
+/* Parse a colon separated list of interval lengths */
+static bool parse_interval_lens(const char *str) {
+  std::vector<uint64_t> lens;
+  for (;;) {
+    char *p;
+    uint64_t len = strtoull(str, &p, 0);
+    if (p == str || !len || (*p != '\0' && *p != ':')) return false;
+    lens.push_back(len);
+    if (*p == '\0') break;
+    str = p + 1;
+  }
+
+  std::sort(lens.begin(), lens.end());
+  for (size_t i = 1; i < lens.size(); ++i) {
+    if (lens[i] == lens[i - 1] || lens[i] % lens[0]) return false;
+  }
+  interval_len = lens[0];
+  coarse_lens.assign(lens.begin() + 1, lens.end());
+  return true;
+}
+
+static bool parse_args(int argc, char **argv, std::string &bbv_file_name,
+                       std::string &trace_file_name,
+                       std::string &proj_file_name,
+                       std::string &phase_file_name,
+                       std::string &perf_file_name) {
 #define STARTS_WITH(str, prefix) \
   (strncmp(str, prefix "=", sizeof(prefix "=") - 1) == 0)
 #define VALUE_OF(str, prefix) (str + sizeof(prefix "=") - 1)
@@ -82,12 +551,159 @@ static bool parse_args(int argc, char **argv, std::string &bbv_file_name) {
                 "checkpoint func start");
     } else if (STARTS_WITH(argv[i], "ckpt_len")) {
       PARSE_ULL(ckpt_func_len, argv[i], "ckpt_len", "checkpoint func len");
+    } else if (STARTS_WITH(argv[i], "interval")) {
+      if (!parse_interval_lens(VALUE_OF(argv[i], "interval"))) {
+        std::cerr << "Invalid interval lengths, coarser ones must be "
+                     "multiples of the finest: "
+                  << VALUE_OF(argv[i], "interval") << std::endl;
+        return false;
+      }
     } else if (STARTS_WITH(argv[i], "bbv_file")) {
       bbv_file_name = VALUE_OF(argv[i], "bbv_file");
       if (bbv_file_name.empty()) {
         std::cerr << "BBV file name can not be empty" << std::endl;
         return false;
       }
+    } else if (STARTS_WITH(argv[i], "trace_file")) {
+      trace_file_name = VALUE_OF(argv[i], "trace_file");
+      if (trace_file_name.empty()) {
+        std::cerr << "Trace file name can not be empty" << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "project")) {
+      uint64_t dims;
+      PARSE_ULL(dims, argv[i], "project", "projection dimensions");
+      if (!dims || dims > PROJECTED_MAX_DIMS) {
+        std::cerr << "Invalid projection dimensions: " << dims << std::endl;
+        return false;
+      }
+      project_dims = dims;
+    } else if (STARTS_WITH(argv[i], "proj_file")) {
+      proj_file_name = VALUE_OF(argv[i], "proj_file");
+      if (proj_file_name.empty()) {
+        std::cerr << "Projected vector file name can not be empty"
+                  << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "project_only")) {
+      uint64_t only;
+      PARSE_ULL(only, argv[i], "project_only", "projection only");
+      project_only = only;
+    } else if (STARTS_WITH(argv[i], "phases")) {
+      char *p;
+      phase_threshold = strtod(VALUE_OF(argv[i], "phases"), &p);
+      if (*p != '\0' || !(phase_threshold > 0)) {
+        std::cerr << "Invalid phase distance threshold: "
+                  << VALUE_OF(argv[i], "phases") << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "phase_file")) {
+      phase_file_name = VALUE_OF(argv[i], "phase_file");
+      if (phase_file_name.empty()) {
+        std::cerr << "Phase file name can not be empty" << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "stop_after_stable")) {
+      PARSE_ULL(stop_after_stable, argv[i], "stop_after_stable",
+                "stable intervals");
+    } else if (STARTS_WITH(argv[i], "start_interval")) {
+      PARSE_ULL(start_interval, argv[i], "start_interval", "start interval");
+    } else if (STARTS_WITH(argv[i], "end_interval")) {
+      PARSE_ULL(end_interval, argv[i], "end_interval", "end interval");
+    } else if (STARTS_WITH(argv[i], "sample")) {
+      PARSE_ULL(sample_period, argv[i], "sample", "sampling period");
+      if (!HAS_COND_CB && sample_period) {
+        std::cerr << "Sampling requires conditional callbacks of QEMU "
+                     "plugin API v3"
+                  << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "perf")) {
+      auto mode = VALUE_OF(argv[i], "perf");
+      if (!strcmp(mode, "off")) {
+        perf_mode = PERF_OFF;
+      } else if (!strcmp(mode, "count")) {
+        perf_mode = PERF_COUNT;
+      } else if (!strcmp(mode, "baseline")) {
+        perf_mode = PERF_BASELINE;
+      } else {
+        std::cerr << "Invalid perf mode: " << mode << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "perf_file")) {
+      perf_file_name = VALUE_OF(argv[i], "perf_file");
+      if (perf_file_name.empty()) {
+        std::cerr << "Perf file name can not be empty" << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "blocks_file")) {
+      blocks_file_name = VALUE_OF(argv[i], "blocks_file");
+      if (blocks_file_name.empty()) {
+        std::cerr << "Block dictionary file name can not be empty"
+                  << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "stats_file")) {
+      stats_file_name = VALUE_OF(argv[i], "stats_file");
+      if (!STATS || stats_file_name.empty()) {
+        std::cerr << "Statistics file requires a build with STATS=1, and a "
+                     "name"
+                  << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "ids")) {
+      auto scheme = VALUE_OF(argv[i], "ids");
+      if (!strcmp(scheme, "order")) {
+        id_scheme = IDS_ORDER;
+      } else if (!strcmp(scheme, "pc")) {
+        id_scheme = IDS_PC;
+      } else if (!strcmp(scheme, "dict")) {
+        id_scheme = IDS_DICT;
+      } else {
+        std::cerr << "Invalid id scheme: " << scheme << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "format")) {
+      auto format = VALUE_OF(argv[i], "format");
+      if (!parse_format(format, bbv_format)) {
+        std::cerr << "Invalid format: " << format << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "codec")) {
+      if (!parse_codec(VALUE_OF(argv[i], "codec"), codec_options.codec)) {
+        std::cerr << "Invalid codec: " << VALUE_OF(argv[i], "codec")
+                  << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "level")) {
+      char *p;
+      auto value = VALUE_OF(argv[i], "level");
+      long level = strtol(value, &p, 0);
+      codec_options.level = level;
+      if (*p != '\0' || p == value || codec_options.level != level ||
+          level == CODEC_DEFAULT_LEVEL) {
+        std::cerr << "Invalid compression level: " << value << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "strategy")) {
+      if (!parse_gzip_strategy(VALUE_OF(argv[i], "strategy"),
+                               codec_options.strategy)) {
+        std::cerr << "Invalid gzip strategy: "
+                  << VALUE_OF(argv[i], "strategy") << std::endl;
+        return false;
+      }
+    } else if (STARTS_WITH(argv[i], "long")) {
+      uint64_t long_mode;
+      PARSE_ULL(long_mode, argv[i], "long", "zstd long distance matching");
+      codec_options.long_mode = long_mode;
+    } else if (STARTS_WITH(argv[i], "compress_threads")) {
+      uint64_t threads;
+      PARSE_ULL(threads, argv[i], "compress_threads", "compression threads");
+      if (!threads || threads > 256) {
+        std::cerr << "Invalid compression threads: " << threads << std::endl;
+        return false;
+      }
+      codec_options.threads = threads;
     } else {
       std::cerr << "Unknown option: " << argv[i] << std::endl;
       return false;
@@ -98,109 +714,1046 @@ static bool parse_args(int argc, char **argv, std::string &bbv_file_name) {
 #undef VALUE_OF
 #undef PARSE_ULL
 
+  if (!check_codec_options(codec_options)) return false;
+  if (stop_after_stable && !phase_threshold) {
+    std::cerr << "Stopping after stable phases requires phases" << std::endl;
+    return false;
+  }
+  if (perf_mode == PERF_BASELINE &&
+      (!trace_file_name.empty() || project_dims || phase_threshold ||
+       !coarse_lens.empty())) {
+    std::cerr << "Baseline perf mode does not count blocks, so it can not "
+                 "be used with traces, projection, phases or several "
+                 "interval lengths"
+              << std::endl;
+    return false;
+  }
+  if (end_interval && end_interval <= start_interval) {
+    std::cerr << "End interval must be after the start interval" << std::endl;
+    return false;
+  }
+  if (id_scheme == IDS_DICT && blocks_file_name.empty()) {
+    std::cerr << "Dictionary ids require blocks_file" << std::endl;
+    return false;
+  }
+  if (sample_period && !trace_file_name.empty()) {
+    std::cerr << "Sampled blocks can not be traced" << std::endl;
+    return false;
+  }
+  if (project_only && (!project_dims || !coarse_lens.empty())) {
+    std::cerr << "Projection only requires project, and a single interval "
+                 "length"
+              << std::endl;
+    return false;
+  }
+  if (interval_len) {
+    if (ckpt_func_start || ckpt_func_len) {
+      std::cerr << "Checkpoint function can not be used with fixed-length "
+                   "intervals"
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
   return ckpt_func_start && ckpt_func_len;
 }
 
-static void plugin_init(const std::string &bbv_file_name) {
-  bbv_file = gzopen(bbv_file_name.c_str(), "w");
-  hotblocks = g_hash_table_new(NULL, NULL);
+/*
+ * Name of the file of an interval length when there are several, the
+ * length is inserted before the codec suffix.
+ */
+static std::string interval_file_name(const std::string &bbv_file_name,
+                                      uint64_t len) {
+  std::string suffix(codec_suffix(codec_options.codec));
+  size_t pos = bbv_file_name.size();
+  if (pos > suffix.size() &&
+      !bbv_file_name.compare(pos - suffix.size(), suffix.size(), suffix)) {
+    pos -= suffix.size();
+  }
+  auto name = bbv_file_name;
+  return name.insert(pos, "." + std::to_string(len));
+}
+
+/* Open a file starting with the given header */
+static BbvWriter *open_writer(const std::string &file_name,
+                              const CodecOptions &options,
+                              const std::string &header) {
+  auto file = open_encoder(file_name, options);
+  if (!file) {
+    std::cerr << "Failed to open output file: " << file_name << std::endl;
+    return nullptr;
+  }
+  auto writer = new BbvWriter(file, file_name);
+  auto buf = writer->get_buffer();
+  buf->append(header);
+  writer->put_buffer(buf);
+  return writer;
+}
+
+static BbvWriter *open_bbv_writer(const std::string &file_name) {
+  std::string header;
+  bbv_encoder.begin_file(header);
+  return open_writer(file_name, codec_options, header);
+}
+
+/*
+ * Open the trace file, compressed by its suffix. Long distance matching
+ * of zstd finds the loops of a program that span beyond a window.
+ */
+static bool open_trace(const std::string &trace_file_name) {
+  CodecOptions options = {CODEC_NONE, CODEC_DEFAULT_LEVEL,
+                          Z_DEFAULT_STRATEGY, true, 1};
+  if (!codec_of_file(trace_file_name, options.codec)) return false;
+  trace_writer = open_writer(
+      trace_file_name, options, std::string(kTraceHeader, TRACE_HEADER_SIZE));
+  return trace_writer;
+}
+
+static bool open_projection(const std::string &proj_file_name) {
+  std::string header;
+  append_projected_header(header, project_dims);
+  proj_writer = open_writer(proj_file_name, codec_options, header);
+  return proj_writer;
+}
+
+/* Phases are written as text lines of "<interval index> <phase>" */
+static bool open_phases(const std::string &phase_file_name) {
+  CodecOptions options = {CODEC_NONE, CODEC_DEFAULT_LEVEL,
+                          Z_DEFAULT_STRATEGY, false, 1};
+  if (!codec_of_file(phase_file_name, options.codec)) return false;
+  phase_writer = open_writer(phase_file_name, options, "");
+  return phase_writer;
+}
+
+/*
+ * Open the counters of the calling thread as a group, read together
+ * through the leader, which is fds[0]. Only user space is counted, which
+ * is allowed without privileges.
+ */
+static bool open_perf_group(int fds[PERF_EVENTS]) {
+  static const uint64_t configs[PERF_EVENTS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+  for (int i = 0; i < PERF_EVENTS; ++i) {
+    struct perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = configs[i];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i ? fds[0] : -1, 0);
+    if (fds[i] < 0) {
+      int error = errno;
+      while (i--) close(fds[i]);
+      errno = error;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Host counters are written as text lines of "<interval index> <cycles>
+ * <instructions> <cache misses> <branch misses>". Counters are tried once
+ * here, so a host without them fails early.
+ */
+static bool open_perf(const std::string &perf_file_name) {
+  int fds[PERF_EVENTS];
+  if (!open_perf_group(fds)) {
+    std::cerr << "Failed to open host performance counters: "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  for (int fd : fds) close(fd);
+
+  CodecOptions options = {CODEC_NONE, CODEC_DEFAULT_LEVEL,
+                          Z_DEFAULT_STRATEGY, false, 1};
+  if (!codec_of_file(perf_file_name, options.codec)) return false;
+  perf_writer = open_writer(perf_file_name, options, "");
+  return perf_writer;
+}
+
+/* Load the ids of an existing dictionary, which is extended at exit */
+static bool load_dict() {
+  if (access(blocks_file_name.c_str(), F_OK)) return true;
+  uint64_t first_interval;
+  std::vector<BlockDef> defs;
+  if (!read_blocks(blocks_file_name, first_interval, defs)) return false;
+  for (const auto &def : defs) {
+    dict_ids[{def.pc, def.insns}] = def.id;
+    dict_max_id = std::max(dict_max_id, def.id);
+  }
+  return true;
+}
+
+/* Close the writers opened so far, once starting the plugin failed */
+static void close_opened_writers() {
+  for (auto writer :
+       {bbv_writer, trace_writer, proj_writer, phase_writer, perf_writer}) {
+    if (!writer) continue;
+    writer->close();
+    delete writer;
+  }
+  for (auto &stream : coarse_streams) {
+    stream.writer->close();
+    delete stream.writer;
+  }
+  bbv_writer = trace_writer = proj_writer = phase_writer = perf_writer =
+      nullptr;
+  coarse_streams.clear();
+}
+
+/* Open the output files, each written by its own thread */
+static bool open_writers(const std::string &bbv_file_name,
+                         const std::string &trace_file_name,
+                         const std::string &proj_file_name,
+                         const std::string &phase_file_name,
+                         const std::string &perf_file_name) {
+  /* host counters are tried first, as the most likely to fail */
+  if (perf_mode != PERF_OFF && !open_perf(perf_file_name)) return false;
+  if (project_only || perf_mode == PERF_BASELINE) {
+    bbv_writer = nullptr;
+  } else if (coarse_lens.empty()) {
+    bbv_writer = open_bbv_writer(bbv_file_name);
+    if (!bbv_writer) return false;
+  } else {
+    bbv_writer =
+        open_bbv_writer(interval_file_name(bbv_file_name, interval_len));
+    if (!bbv_writer) return false;
+  }
+
+  for (auto len : coarse_lens) {
+    CoarseStream stream = {len / interval_len, 0, 0, nullptr,
+                           IntervalEncoder(bbv_format)};
+    stream.writer = open_bbv_writer(interval_file_name(bbv_file_name, len));
+    if (!stream.writer) return false;
+    coarse_streams.push_back(std::move(stream));
+  }
+  if (!trace_file_name.empty() && !open_trace(trace_file_name)) return false;
+  if (project_dims && !open_projection(proj_file_name)) return false;
+  if (phase_threshold && !open_phases(phase_file_name)) return false;
+  return true;
+}
+
+static bool plugin_init(const std::string &bbv_file_name,
+                        const std::string &trace_file_name,
+                        const std::string &proj_file_name,
+                        const std::string &phase_file_name,
+                        const std::string &perf_file_name) {
+  bbv_encoder = IntervalEncoder(bbv_format);
+  /* writer threads are counted from their start */
+  if (perf_mode != PERF_OFF) output_thread_hook = open_thread_perf;
+  if (id_scheme == IDS_DICT && !load_dict()) return false;
+  if (!open_writers(bbv_file_name, trace_file_name, proj_file_name,
+                    phase_file_name, perf_file_name)) {
+    /* no writer thread is left running once the plugin is rejected */
+    close_opened_writers();
+    return false;
+  }
+  /* phases are detected on projected vectors even if not written */
+  if (phase_threshold && !project_dims) project_dims = PROJECT_DIMS;
+  if (project_dims) {
+    projection = new Projection(project_dims);
+    proj_sum.resize(project_dims);
+    proj_vec.resize(project_dims);
+  }
+
+  hotblocks.resize(HOTBLOCKS_INIT_SIZE);
+#if HAS_COND_CB
+  ckpt_exec_num = new_counter();
+#else
+  user_exec_num = new_counter();
+#endif
+  insn_count = new_counter();
+#if HAS_COND_CB
+  if (sample_period) {
+    sample_states = qemu_plugin_scoreboard_new(sizeof(SampleState));
+    sample_count =
+        qemu_plugin_scoreboard_u64_in_struct(sample_states, SampleState, count);
+  }
+#endif
+  /* there is no checkpoint to skip */
+  if (interval_len) is_first_ckpt = false;
+  skipping = start_interval > 0;
+  return true;
+}
+
+/* lock required for this function */
+static void dump_coarse(CoarseStream &stream) {
+  auto buf = stream.writer->get_buffer();
+  stream.encoder.begin(*buf, stream.interval_num++);
+  std::sort(stream.ids.begin(), stream.ids.end(),
+            [](size_t a, size_t b) { return written_id(a) < written_id(b); });
+  for (auto index : stream.ids) {
+    stream.encoder.add(*buf, written_id(index), stream.sum[index]);
+    stream.sum[index] = 0;
+  }
+  stream.encoder.end(*buf);
+  stream.writer->put_buffer(buf);
+  stream.ids.clear();
+  stream.pending = 0;
+}
+
+/* lock required for this function */
+static void detect_phase() {
+  size_t num_phases = phase_sizes.size();
+  size_t phase = num_phases;
+  double min_dist = phase_threshold * phase_threshold;
+  for (size_t i = 0; i < num_phases; ++i) {
+    auto center = &phase_centers[i * project_dims];
+    double dist = 0;
+    for (unsigned j = 0; j < project_dims; ++j) {
+      double d = proj_vec[j] - center[j];
+      dist += d * d;
+    }
+    if (dist < min_dist) {
+      phase = i;
+      min_dist = dist;
+    }
+  }
+
+  if (phase == num_phases) {
+    phase_centers.insert(phase_centers.end(), proj_vec.begin(),
+                         proj_vec.end());
+    phase_sizes.push_back(1);
+    stable_intervals = 0;
+  } else {
+    /* running mean of the intervals in the phase */
+    auto center = &phase_centers[phase * project_dims];
+    auto size = ++phase_sizes[phase];
+    for (unsigned j = 0; j < project_dims; ++j) {
+      center[j] += (proj_vec[j] - center[j]) / size;
+    }
+    stable_intervals++;
+  }
+
+  char line[U64_MAX_DIGITS * 2 + 2];
+  char *p = line;
+  p += format_u64(p, interval_num);
+  *p++ = ' ';
+  p += format_u64(p, phase);
+  *p++ = '\n';
+  auto buf = phase_writer->get_buffer();
+  buf->append(line, p - line);
+  phase_writer->put_buffer(buf);
+
+  if (stop_after_stable && stable_intervals >= stop_after_stable) {
+    std::cerr << "No new phases in " << stable_intervals
+              << " intervals, stopping emulation" << std::endl;
+    stop_requested = true;
+  }
+}
+
+/* lock required for this function */
+static void dump_projected(uint64_t total) {
+  for (unsigned i = 0; i < project_dims; ++i) {
+    proj_vec[i] = total ? proj_sum[i] / total : 0;
+    proj_sum[i] = 0;
+  }
+  if (proj_writer) {
+    auto buf = proj_writer->get_buffer();
+    append_projected(*buf, interval_num, total, proj_vec.data(),
+                     project_dims);
+    proj_writer->put_buffer(buf);
+  }
+  if (phase_writer) detect_phase();
+}
+
+/*
+ * Approximate the error of a sampled interval, the Manhattan distance
+ * between the estimated and exact normalized vectors. The random error
+ * shrinks with the square root of the number of samples, so the distance
+ * between two independent halves is about twice the error of the whole.
+ * Neither half sees the bias of periods across boundaries, so the real
+ * error is usually higher. Lock required.
+ */
+static void end_sampled_interval(double half_dist) {
+  if (half_insns[0] && half_insns[1]) {
+    sample_error_sum += half_dist / 2;
+    sampled_intervals++;
+  }
+  total_samples += interval_samples;
+  interval_samples = 0;
+  half_insns[0] = half_insns[1] = 0;
+}
+
+/* Sum the counters of all threads, lock required for this function */
+static void read_perf(uint64_t sums[PERF_EVENTS]) {
+  memset(sums, 0, sizeof(uint64_t) * PERF_EVENTS);
+  for (int leader : perf_groups) {
+    struct {
+      uint64_t nr;
+      uint64_t values[PERF_EVENTS];
+    } group;
+    if (read(leader, &group, sizeof(group)) != sizeof(group)) continue;
+    for (int i = 0; i < PERF_EVENTS; ++i) sums[i] += group.values[i];
+  }
+}
+
+/* lock required for this function */
+static void dump_perf() {
+  uint64_t sums[PERF_EVENTS];
+  read_perf(sums);
+  char line[U64_MAX_DIGITS * (PERF_EVENTS + 1) + PERF_EVENTS + 1];
+  char *p = line;
+  p += format_u64(p, interval_num);
+  for (int i = 0; i < PERF_EVENTS; ++i) {
+    *p++ = ' ';
+    p += format_u64(p, sums[i] - perf_last[i]);
+    perf_last[i] = sums[i];
+  }
+  *p++ = '\n';
+  auto buf = perf_writer->get_buffer();
+  buf->append(line, p - line);
+  perf_writer->put_buffer(buf);
+}
+
+/* Count a dumped interval, lock required for this function */
+static void next_interval() {
+  if (++interval_num == end_interval) {
+    std::cerr << "Reached interval " << end_interval
+              << ", stopping emulation" << std::endl;
+    stop_requested = true;
+  }
 }
 
 /* lock required for this function */
 static void dump_bbv() {
-  if (auto it = g_hash_table_get_values(hotblocks)) {
-    std::ostringstream bb_stat;
-    bb_stat << "T";
+  if (skipping) {
+    /* only with fixed-length intervals, checkpoints are counted on entry */
+    if (++interval_num == start_interval) start_requested = true;
+    return;
+  }
+  if (perf_mode == PERF_BASELINE) {
+    /* nothing is counted, the interval only ends */
+    dump_perf();
+    next_interval();
+    return;
+  }
+  if (unique_trans_id) {
+    STAT_TIMER(dump_start);
+    /* host counters stop before the cost of dumping */
+    if (perf_writer) dump_perf();
+    /* buffers are reused, so their capacity grows to fit a whole line */
+    std::string *buf = nullptr;
+    if (bbv_writer) {
+      buf = bbv_writer->get_buffer();
+      bbv_encoder.begin(*buf, interval_num);
+    }
+    uint64_t total = 0;
+    double half_dist = 0; /* Manhattan distance of normalized halves */
+
+    STAT_TIMER(format_start);
+    for (size_t i = 0; i < counter_chunks.size(); ++i) {
+      auto dirty = collect_counter_chunk(counter_chunks[i], chunk_exec_count);
+      for (; dirty; dirty &= dirty - 1) {
+        size_t group = __builtin_ctz(dirty) * DIRTY_GROUP;
+        for (size_t j = group; j < group + DIRTY_GROUP; ++j) {
+          if (auto exec_count = chunk_exec_count[j]) {
+            size_t index = i * COUNTER_CHUNK + j;
+            uint64_t count = exec_count * block_insns[index];
+            if (buf && id_scheme == IDS_ORDER) {
+              bbv_encoder.add(*buf, index + 1, count);
+            } else if (buf) {
+              stable_entries.push_back({stable_ids[index], count});
+            }
+            if (sample_period) {
+              double second = half_count[index] * block_insns[index];
+              half_count[index] = 0;
+              half_dist += fabs((count - second) / half_insns[0] -
+                                second / half_insns[1]);
+            }
+            if (projection) {
+              projection->add(proj_sum.data(), written_id(index), count);
+              total += count;
+            }
+            for (auto &stream : coarse_streams) {
+              if (!stream.sum[index]) stream.ids.push_back(index);
+              stream.sum[index] += count;
+            }
+          }
+        }
+      }
+    }
 
-    for (; it; it = it->next) {
-      auto rec = reinterpret_cast<ExecCount *>(it->data);
-      if (rec->exec_count) {
-        bb_stat << " :" << rec->id << ":" << rec->exec_count * rec->insns;
-        rec->exec_count = 0;
+    /* stable ids are not in translation order, but records need order */
+    if (!stable_entries.empty()) {
+      std::sort(stable_entries.begin(), stable_entries.end());
+      for (const auto &entry : stable_entries) {
+        bbv_encoder.add(*buf, entry.first, entry.second);
       }
+      stable_entries.clear();
+    }
+    STAT_TIME(STAT_FORMAT_NS, format_start);
+    if (sample_period) end_sampled_interval(half_dist);
+
+    if (buf) {
+      bbv_encoder.end(*buf);
+      bbv_writer->put_buffer(buf);
+    }
+    if (projection) dump_projected(total);
+    next_interval();
+
+    for (auto &stream : coarse_streams) {
+      if (++stream.pending == stream.ratio) dump_coarse(stream);
+    }
+    STAT_INC(STAT_DUMPS);
+    STAT_TIME(STAT_DUMP_NS, dump_start);
+  }
+}
+
+/* lock required for this function */
+static void write_trace(unsigned int cpu_index, std::string &records) {
+  auto buf = trace_writer->get_buffer();
+  buf->swap(trace_defs);
+  append_trace_vcpu(*buf, cpu_index);
+  buf->append(records);
+  trace_writer->put_buffer(buf);
+  records.clear();
+}
+
+/*
+ * Write the pending records of a vCPU, ending them with a checkpoint if
+ * ckpt is set. Both the lock and the mutex of the buffer are required.
+ */
+static void write_trace_buffer(unsigned int cpu_index, TraceBuffer *trace,
+                               bool ckpt) {
+  if (ckpt) {
+    trace->encoder.checkpoint(trace->buf);
+  } else {
+    trace->encoder.flush(trace->buf);
+  }
+  if (!trace->full.empty()) write_trace(cpu_index, trace->full);
+  /* definitions are written even if no records follow */
+  if (!trace->buf.empty() || !trace_defs.empty()) {
+    write_trace(cpu_index, trace->buf);
+  }
+}
+
+/*
+ * Close a writer. With statistics, report how often emulation waited for
+ * it, and add its statistics to those of the plugin.
+ */
+static void close_writer(BbvWriter *writer) {
+  if (!writer->close()) {
+    std::cerr << "Failed to write output file: " << writer->file_name()
+              << std::endl;
+  }
+
+#if STATS
+  auto &stats = writer->stats();
+  std::cerr << writer->file_name() << ": max queue depth "
+            << stats.max_queue_depth << "/" << WRITER_QUEUE_LEN
+            << ", stalled " << stats.stalls << " times for "
+            << stats.stall_ns / 1000000.0 << " ms" << std::endl;
+  STAT_ADD(STAT_BYTES_WRITTEN, stats.bytes);
+  STAT_ADD(STAT_WRITE_NS, stats.write_ns);
+  STAT_ADD(STAT_WRITER_STALLS, stats.stalls);
+  STAT_ADD(STAT_WRITER_STALL_NS, stats.stall_ns);
+  STAT_MAX(STAT_MAX_QUEUE_DEPTH, stats.max_queue_depth);
+#endif
+  delete writer;
+}
+
+/* Write the pc and size of every block id, lock required for this function */
+static void write_blocks() {
+  std::vector<BlockDef> defs;
+  if (id_scheme == IDS_DICT) {
+    /* blocks of earlier runs are kept */
+    for (const auto &entry : dict_ids) {
+      defs.push_back({entry.second, entry.first.first, entry.first.second});
+    }
+  } else {
+    for (const auto &rec : hotblocks) {
+      if (rec.id) defs.push_back({written_id(rec.id - 1), rec.pc, rec.insns});
     }
+  }
+  std::sort(defs.begin(), defs.end(),
+            [](const BlockDef &a, const BlockDef &b) { return a.id < b.id; });
+  std::string buf;
+  append_blocks_header(buf, start_interval);
+  for (const auto &def : defs) append_block_def(buf, def);
 
-    bb_stat << std::endl;
-    gzwrite(bbv_file, bb_stat.str().c_str(), bb_stat.str().length());
+  std::ofstream out(blocks_file_name, std::ios::binary);
+  out.write(buf.data(), buf.size());
+  out.close();
+  if (!out) {
+    std::cerr << "Failed to write block dictionary: " << blocks_file_name
+              << std::endl;
   }
 }
 
+#if STATS
+static void report_stats() {
+  STAT_SET(STAT_BLOCKS, unique_trans_id);
+  STAT_SET(STAT_TABLE_SLOTS, hotblocks.size());
+  if (stats_file_name.empty()) {
+    std::cerr << "Plugin statistics:" << std::endl;
+    print_stats(std::cerr, false);
+    return;
+  }
+  std::ofstream out(stats_file_name);
+  print_stats(out, true);
+  out.close();
+  if (!out) {
+    std::cerr << "Failed to write statistics file: " << stats_file_name
+              << std::endl;
+  }
+}
+#endif
+
+/*
+ * Called at exit, or when emulation is stopped early. The lock is kept
+ * afterwards, so vCPUs still running can not touch the closed files.
+ */
 static void plugin_exit(qemu_plugin_id_t id, void *p) {
-  lock.lock();
+  static std::atomic<bool> exited{false};
+  if (exited.exchange(true)) return;
+  stat_lock(lock);
+
+  if (stop_requested) {
+    /* the last interval has just been dumped */
+  } else if (interval_len) {
+    if (get_counter(insn_count)) dump_bbv();
+  } else {
+#if HAS_COND_CB
+    if (!is_first_ckpt) dump_bbv();
+#else
+    if (!is_first_ckpt && get_counter(user_exec_num)) dump_bbv();
+#endif
+  }
+  /* the last coarse intervals are partial */
+  for (auto &stream : coarse_streams) {
+    if (stream.pending) dump_coarse(stream);
+  }
+
+  uint64_t dumped = skipping ? 0 : interval_num - start_interval;
+  if (trace_writer) {
+    /* other vCPUs may still be running if emulation is stopped early */
+    for (unsigned int i = 0; i < TRACE_MAX_VCPUS; ++i) {
+      auto trace = trace_buffers[i];
+      if (!trace) continue;
+      std::lock_guard<std::mutex> guard(trace->mutex);
+      write_trace_buffer(i, trace, false);
+      trace->closed = true;
+    }
+  }
+
+  if (bbv_writer) close_writer(bbv_writer);
+  for (auto &stream : coarse_streams) close_writer(stream.writer);
+  if (trace_writer) close_writer(trace_writer);
+  if (proj_writer) close_writer(proj_writer);
+  if (perf_writer) close_writer(perf_writer);
+  if (!blocks_file_name.empty()) write_blocks();
+  if (phase_writer) {
+    close_writer(phase_writer);
+    std::cerr << "Detected " << phase_sizes.size() << " phases in "
+              << dumped << " intervals" << std::endl;
+  }
+  if (sample_period && sampled_intervals) {
+    std::cerr << "Sampled " << total_samples / dumped
+              << " blocks per interval, approximate mean error of "
+                 "normalized BBVs "
+              << sample_error_sum / sampled_intervals << std::endl;
+  }
+#if STATS
+  report_stats();
+#endif
+}
+
+/*
+ * Write everything and end emulation, once requested by a dump. The plugin
+ * API has no call to ask QEMU to shut down, so the process exits while
+ * other vCPUs may still be running callbacks. This is safe as plugin_exit
+ * has run first and keeps the lock: the exit of QEMU returns at its guard,
+ * callbacks that touch what static destructors free take the lock first
+ * and block, trace_exec only sees its own closed buffer, and inline ops
+ * write counters that are never freed.
+ */
+static void stop_emulation() {
+  static std::atomic<bool> stopping{false};
+  if (stopping.exchange(true)) {
+    /* another vCPU is writing everything, and exits once done */
+    for (;;) pause();
+  }
+  plugin_exit(0, NULL);
+  exit(0);
+}
+
+/* lock required for this function */
+static void handle_ckpt() {
+  /* skip the first checkpoint */
+  if (is_first_ckpt) {
+    is_first_ckpt = false;
+    for (size_t i = 0; i < counter_chunks.size(); ++i) {
+      collect_counter_chunk(counter_chunks[i], chunk_exec_count);
+    }
+    if (perf_writer) read_perf(perf_last);
+    if (sample_period) {
+      std::fill(half_count.begin(), half_count.end(), 0);
+      half_insns[0] = half_insns[1] = 0;
+      interval_samples = 0;
+    }
+  } else {
+    dump_bbv();
+  }
+}
+
+static void tb_record(qemu_plugin_id_t id, struct qemu_plugin_tb *tb);
 
-  if (!is_first_ckpt) dump_bbv();
+/*
+ * Called by QEMU once the instrumentation for skipping is removed, and TBs
+ * are flushed, with all vCPUs stopped. The interval of start_interval
+ * starts here.
+ */
+static void plugin_reset(qemu_plugin_id_t id) {
+  stat_lock(lock);
+  skipping = false;
+  interval_num = start_interval;
+  if (perf_writer) read_perf(perf_last);
+  if (!interval_len) {
+#if HAS_COND_CB
+    /*
+     * The rest of the checkpoint function may run instrumented, so the
+     * first user TB of this vCPU ends the checkpoint, dropping the counts
+     * of the checkpoint function.
+     */
+    qemu_plugin_u64_set(ckpt_exec_num, reset_vcpu, 1);
+#else
+    /* ckpt_exec ignores the rest of the checkpoint function */
+    is_first_ckpt = false;
+#endif
+  }
+  lock.unlock();
+  qemu_plugin_register_vcpu_tb_trans_cb(id, tb_record);
+  qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+}
 
-  auto it = g_hash_table_get_values(hotblocks);
-  if (it) g_list_free(it);
+/* Reset the plugin once, to count blocks from the start interval on */
+static void start_counting(unsigned int cpu_index) {
+  static std::atomic<bool> started{false};
+  if (started.exchange(true)) return;
+  reset_vcpu = cpu_index;
+  qemu_plugin_reset(plugin_id, plugin_reset);
+}
 
+/* Called on the entry of the checkpoint function while skipping */
+static void skip_exec(unsigned int cpu_index, void *udata) {
+  STAT_INC(STAT_CALLBACKS);
+  stat_lock(lock);
+  /* the first checkpoint starts interval 0 */
+  bool start = ++skipped_ckpts == start_interval + 1;
   lock.unlock();
-  gzclose(bbv_file);
+  if (start) start_counting(cpu_index);
+}
+
+/* lock required for this function */
+static TraceBuffer *new_trace_buffer(unsigned int cpu_index) {
+  auto &trace = trace_buffers[cpu_index];
+  if (!trace) trace = new TraceBuffer;
+  return trace;
 }
 
+/* Buffers are only created by their own vCPU, under the lock */
+static TraceBuffer *get_trace_buffer(unsigned int cpu_index) {
+  auto trace = trace_buffers[cpu_index];
+  if (trace) return trace;
+  stat_lock(lock);
+  trace = new_trace_buffer(cpu_index);
+  lock.unlock();
+  return trace;
+}
+
+/*
+ * Write the records of all vCPUs at an interval boundary, those of the
+ * vCPU ending the interval last and with a checkpoint if ckpt is set. Lock
+ * required for this function.
+ */
+static void sync_traces(unsigned int cpu_index, bool ckpt) {
+  if (!trace_writer) return;
+  new_trace_buffer(cpu_index);
+  for (unsigned int i = 0; i < TRACE_MAX_VCPUS; ++i) {
+    auto trace = trace_buffers[i];
+    if (!trace || i == cpu_index) continue;
+    std::lock_guard<std::mutex> guard(trace->mutex);
+    if (!trace->closed) write_trace_buffer(i, trace, false);
+  }
+  auto trace = trace_buffers[cpu_index];
+  std::lock_guard<std::mutex> guard(trace->mutex);
+  if (!trace->closed) write_trace_buffer(cpu_index, trace, ckpt);
+}
+
+/* lock required for this function */
+static void trace_ckpt(unsigned int cpu_index) {
+  sync_traces(cpu_index, true);
+}
+
+#if HAS_COND_CB
+/* Only called on the first user TB after the checkpoint function. */
 static void user_exec(unsigned int cpu_index, void *udata) {
-  lock.lock();
-  if (ckpt_exec_num) {
-    /* skip the first checkpoint */
-    if (is_first_ckpt) {
-      is_first_ckpt = false;
-      auto zero_exec_count = [](gpointer data, gpointer udata) {
-        reinterpret_cast<ExecCount *>(data)->exec_count = 0;
-      };
-      g_list_foreach(g_hash_table_get_values(hotblocks), zero_exec_count, NULL);
-    } else {
-      dump_bbv();
-    }
-    ckpt_exec_num = 0;
+  STAT_INC(STAT_CALLBACKS);
+  stat_lock(lock);
+  handle_ckpt();
+  trace_ckpt(cpu_index);
+  clear_counter(ckpt_exec_num);
+  lock.unlock();
+  if (stop_requested) stop_emulation();
+}
+#else
+/*
+ * Called on every checkpoint function TB. User TBs only bump counters
+ * inline, so interval boundaries are handled here rather than on the first
+ * user TB after the checkpoint. Nothing but kernel code runs in between, so
+ * the counts seen here are the same.
+ */
+static void ckpt_exec(unsigned int cpu_index, void *udata) {
+  STAT_INC(STAT_CALLBACKS);
+  stat_lock(lock);
+  /* consecutive checkpoints without user code form a single boundary */
+  if (is_first_ckpt || get_counter(user_exec_num)) {
+    handle_ckpt();
+    trace_ckpt(cpu_index);
+  }
+  clear_counter(user_exec_num);
+  lock.unlock();
+  if (stop_requested) stop_emulation();
+}
+#endif
+
+/* lock required for this function */
+static uint64_t alloc_block_id(uint64_t pc, uint64_t insns) {
+  if (unique_trans_id % COUNTER_CHUNK == 0) {
+    counter_chunks.push_back(new_counter_chunk());
+  }
+  block_insns.push_back(insns);
+  if (id_scheme != IDS_ORDER) stable_ids.push_back(stable_block_id(pc, insns));
+  for (auto &stream : coarse_streams) stream.sum.push_back(0);
+  if (sample_period) half_count.push_back(0);
+  return ++unique_trans_id;
+}
+
+/*
+ * Called when a vCPU has executed at least interval_len user instructions
+ * since the last boundary. Without conditional callbacks it is called on
+ * every user TB, and checks the count before taking the lock.
+ */
+static void interval_exec(unsigned int cpu_index, void *udata) {
+  STAT_INC(STAT_CALLBACKS);
+#if !HAS_COND_CB
+  if (get_vcpu_counter(insn_count, cpu_index) < interval_len) return;
+#endif
+  stat_lock(lock);
+#if !HAS_COND_CB
+  /* another vCPU may have ended the interval while this one waited */
+  if (get_vcpu_counter(insn_count, cpu_index) < interval_len) {
+    lock.unlock();
+    return;
+  }
+#endif
+  dump_bbv();
+  sync_traces(cpu_index, false);
+  clear_vcpu_counter(insn_count, cpu_index);
+  lock.unlock();
+  if (start_requested) start_counting(cpu_index);
+  if (stop_requested) stop_emulation();
+}
+
+/*
+ * Register the detection of interval boundaries on a user TB. Ops are
+ * emitted in registration order, so this must come before counting the
+ * TB, to handle the boundary before this TB is counted as older QEMU did
+ * for exec callbacks.
+ */
+static void register_user_boundary(struct qemu_plugin_tb *tb, size_t insns) {
+  if (interval_len) {
+#if HAS_COND_CB
+    qemu_plugin_register_vcpu_tb_exec_cond_cb(
+        tb, interval_exec, QEMU_PLUGIN_CB_NO_REGS, QEMU_PLUGIN_COND_GE,
+        insn_count, interval_len, NULL);
+#else
+    qemu_plugin_register_vcpu_tb_exec_cb(tb, interval_exec,
+                                         QEMU_PLUGIN_CB_NO_REGS, NULL);
+#endif
+    register_inline_add(tb, insn_count, insns);
+  } else {
+#if HAS_COND_CB
+    qemu_plugin_register_vcpu_tb_exec_cond_cb(
+        tb, user_exec, QEMU_PLUGIN_CB_NO_REGS, QEMU_PLUGIN_COND_NE,
+        ckpt_exec_num, 0, NULL);
+#else
+    register_inline_add(tb, user_exec_num);
+#endif
   }
+}
+
+/* Record a user TB in the trace of its vCPU */
+static void trace_exec(unsigned int cpu_index, void *udata) {
+  auto trace = get_trace_buffer(cpu_index);
+  std::unique_lock<std::mutex> guard(trace->mutex);
+  if (trace->closed) return;
+  trace->encoder.block(trace->buf, reinterpret_cast<uintptr_t>(udata));
+  if (trace->buf.size() < TRACE_FLUSH_SIZE) return;
+  /* full is only filled by this vCPU, and written by whoever locks first */
+  trace->full.swap(trace->buf);
+  guard.unlock();
+  stat_lock(lock);
+  if (!trace->full.empty()) write_trace(cpu_index, trace->full);
   lock.unlock();
 }
 
-static ExecCount *insert_exec_count(size_t insns, uint64_t hash) {
-  lock.lock();
+static CounterChunk insert_exec_count(uint64_t pc, size_t insns,
+                                      uint64_t *id) {
+  stat_lock(lock);
 
-  auto cnt = reinterpret_cast<ExecCount *>(
-      g_hash_table_lookup(hotblocks, reinterpret_cast<gconstpointer>(hash)));
-  if (!cnt) {
-    cnt = g_new0(ExecCount, 1);
-    cnt->id = ++unique_trans_id;
+  auto cnt = find_block(pc, insns);
+  if (!cnt->id) {
+    /* keep the load factor below 1/2 */
+    if (++hotblocks_num * 2 > hotblocks.size()) {
+      grow_hotblocks();
+      cnt = find_block(pc, insns);
+    }
+    cnt->pc = pc;
     cnt->insns = insns;
-    g_hash_table_insert(hotblocks, reinterpret_cast<gpointer>(hash), cnt);
+    cnt->id = alloc_block_id(pc, insns);
+    if (trace_writer) append_trace_define(trace_defs, cnt->id, pc, insns);
   }
+  auto chunk = counter_chunks[(cnt->id - 1) / COUNTER_CHUNK];
+  *id = cnt->id;
+
+  lock.unlock();
+  return chunk;
+}
+
+#if HAS_COND_CB
+/* Credit a block with the period it ends, and start a new period */
+static void sample_exec(unsigned int cpu_index, void *udata) {
+  auto state = static_cast<SampleState *>(
+      qemu_plugin_scoreboard_find(sample_states, cpu_index));
+  uint64_t period = state->count - state->start;
+  /* xorshift64, seeded on the first sample of a vCPU */
+  uint64_t x = state->rng ? state->rng : 0x9e3779b97f4a7c15ull * ~cpu_index;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  state->rng = x;
+  state->start = sample_period + x % sample_period - sample_period / 2;
+  state->count = state->start;
 
+  auto id = reinterpret_cast<uintptr_t>(udata);
+  size_t index = (id - 1) % COUNTER_CHUNK;
+  stat_lock(lock);
+  auto data = counter_chunk_data(counter_chunks[(id - 1) / COUNTER_CHUNK],
+                                 cpu_index);
+  data[index] += period;
+  data[COUNTER_CHUNK + index / DIRTY_GROUP]++;
+  int half = interval_samples++ & 1;
+  if (half) half_count[id - 1] += period;
+  half_insns[half] += period * block_insns[id - 1];
+  lock.unlock();
+}
+
+/* Count a user TB towards the period, sampling it if the period ends */
+static void register_sampling(struct qemu_plugin_tb *tb, uint64_t block_id) {
+  register_inline_add(tb, sample_count);
+  qemu_plugin_register_vcpu_tb_exec_cond_cb(
+      tb, sample_exec, QEMU_PLUGIN_CB_NO_REGS, QEMU_PLUGIN_COND_GE,
+      sample_count, sample_period * 2, reinterpret_cast<void *>(block_id));
+}
+#endif
+
+/* Count the calling thread from now on, once per thread */
+static void open_thread_perf() {
+  perf_opened = true;
+  int fds[PERF_EVENTS];
+  if (!open_perf_group(fds)) {
+    std::cerr << "Failed to open host performance counters of a thread: "
+              << strerror(errno) << std::endl;
+    return;
+  }
+  stat_lock(lock);
+  perf_groups.push_back(fds[0]);
   lock.unlock();
-  return cnt;
 }
 
 static void tb_record(qemu_plugin_id_t id, struct qemu_plugin_tb *tb) {
   uint64_t pc = qemu_plugin_tb_vaddr(tb);
   size_t insns = qemu_plugin_tb_n_insns(tb);
-  uint64_t hash = pc ^ insns;
+  STAT_INC(STAT_TB_RECORD);
+  if (perf_mode != PERF_OFF && !perf_opened) open_thread_perf();
+  if (skipping) {
+    if (interval_len && pc < MEM_START) {
+      register_user_boundary(tb, insns);
+    } else if (!interval_len && pc == ckpt_func_start) {
+      qemu_plugin_register_vcpu_tb_exec_cb(tb, skip_exec,
+                                           QEMU_PLUGIN_CB_NO_REGS, NULL);
+    }
+    return;
+  }
 
   if (pc < MEM_START) {
-    auto cnt = insert_exec_count(insns, hash);
+    STAT_INC(STAT_USER_TBS);
+    if (perf_mode == PERF_BASELINE) {
+      register_user_boundary(tb, insns);
+      return;
+    }
+    uint64_t block_id;
+    auto chunk = insert_exec_count(pc, insns, &block_id);
+    size_t index = (block_id - 1) % COUNTER_CHUNK;
 
+    register_user_boundary(tb, insns);
+#if HAS_COND_CB
+    if (sample_period) {
+      register_sampling(tb, block_id);
+      return;
+    }
+#endif
     /* count the number of instructions executed */
-    qemu_plugin_register_vcpu_tb_exec_inline(tb, QEMU_PLUGIN_INLINE_ADD_U64,
-                                             &cnt->exec_count, 1);
-    qemu_plugin_register_vcpu_tb_exec_cb(tb, user_exec, QEMU_PLUGIN_CB_NO_REGS,
-                                         reinterpret_cast<void *>(hash));
+    register_inline_add(tb, counter_in_chunk(chunk, index));
+    /* mark the group of this block as dirty */
+    register_inline_add(
+        tb, counter_in_chunk(chunk, COUNTER_CHUNK + index / DIRTY_GROUP));
+    if (trace_writer) {
+      qemu_plugin_register_vcpu_tb_exec_cb(tb, trace_exec,
+                                           QEMU_PLUGIN_CB_NO_REGS,
+                                           reinterpret_cast<void *>(block_id));
+    }
   } else if (pc >= ckpt_func_start && pc < ckpt_func_start + ckpt_func_len) {
+    STAT_INC(STAT_CKPT_TBS);
+#if HAS_COND_CB
     /* count the number of checkpoint function executed */
-    qemu_plugin_register_vcpu_tb_exec_inline(tb, QEMU_PLUGIN_INLINE_ADD_U64,
-                                             &ckpt_exec_num, 1);
+    register_inline_add(tb, ckpt_exec_num);
+#else
+    /* handle interval boundary when checkpoint function executed */
+    qemu_plugin_register_vcpu_tb_exec_cb(tb, ckpt_exec, QEMU_PLUGIN_CB_NO_REGS,
+                                         NULL);
+#endif
   }
 }
 
 QEMU_PLUGIN_EXPORT
 int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info, int argc,
                         char **argv) {
-  std::string bbv_file_name("bbv.gz");
-  if (!parse_args(argc, argv, bbv_file_name)) {
+  std::string bbv_file_name, trace_file_name, proj_file_name;
+  std::string phase_file_name("phases"), perf_file_name("perf");
+  if (!parse_args(argc, argv, bbv_file_name, trace_file_name, proj_file_name,
+                  phase_file_name, perf_file_name)) {
     show_usage();
     return 1;
   }
-  plugin_init(bbv_file_name);
+  if (bbv_file_name.empty()) {
+    bbv_file_name = bbv_format == FORMAT_BINARY ? "bbv.bin" : "bbv";
+    bbv_file_name += codec_suffix(codec_options.codec);
+  }
+  if (proj_file_name.empty()) {
+    proj_file_name = std::string("proj") + codec_suffix(codec_options.codec);
+  }
+  if (!plugin_init(bbv_file_name, trace_file_name, proj_file_name,
+                   phase_file_name, perf_file_name)) {
+    return 1;
+  }
 
+  plugin_id = id;
   qemu_plugin_register_vcpu_tb_trans_cb(id, tb_record);
   qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
   return 0;
@@ -0,0 +1,213 @@
+/*
+ * Measure the throughput of an output codec on BBVs, either synthetic ones
+ * generated like the streams of bbvhost or those of a BBV file. The data
+ * is formatted in memory first, so only compression and writing are timed.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "codec.h"
+#include "format.h"
+#include "output.h"
+#include "reader.h"
+
+/* Options of synthetic BBVs */
+static uint64_t num_blocks = 10000;
+static uint64_t execs_per_interval = 10000;
+static uint64_t num_intervals = 1000;
+static double zipf_exponent = 1.0;
+static uint64_t seed = 42;
+
+static void show_usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] [<input>]" << std::endl;
+  std::cerr << "Measure the throughput of a codec on synthetic BBVs, or "
+               "those of a BBV file."
+            << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -c <codec>        none, gzip, zstd or lz4, gzip by default"
+            << std::endl;
+  std::cerr << "  -l <level>        compression level, the codec's default "
+               "by default"
+            << std::endl;
+  std::cerr << "  -t <threads>      compression threads, gzip only"
+            << std::endl;
+  std::cerr << "  -f text|binary    BBV format, text by default" << std::endl;
+  std::cerr << "  -b <blocks>       distinct blocks, 10000 by default"
+            << std::endl;
+  std::cerr << "  -k <execs>        blocks executed per interval, "
+               "10000 by default"
+            << std::endl;
+  std::cerr << "  -n <intervals>    intervals, 1000 by default" << std::endl;
+  std::cerr << "  -z <exponent>     Zipf exponent of block hotness, "
+               "1 by default"
+            << std::endl;
+  std::cerr << "  -s <seed>         seed of synthetic BBVs" << std::endl;
+}
+
+static void generate(IntervalEncoder &encoder, std::string &data) {
+  std::vector<double> weights(num_blocks);
+  for (uint64_t i = 0; i < num_blocks; ++i) {
+    weights[i] = 1 / pow(i + 1, zipf_exponent);
+  }
+  std::discrete_distribution<uint64_t> zipf(weights.begin(), weights.end());
+  std::mt19937_64 rng(seed);
+  std::vector<uint64_t> sum(num_blocks), ids;
+  for (uint64_t index = 0; index < num_intervals; ++index) {
+    for (uint64_t i = 0; i < execs_per_interval; ++i) {
+      auto block = zipf(rng);
+      if (!sum[block]) ids.push_back(block);
+      sum[block] += 1 + block % 8;
+    }
+    std::sort(ids.begin(), ids.end());
+    encoder.begin(data, index);
+    for (auto block : ids) {
+      encoder.add(data, block + 1, sum[block]);
+      sum[block] = 0;
+    }
+    encoder.end(data);
+    ids.clear();
+  }
+}
+
+static bool load(const char *file_name, IntervalEncoder &encoder,
+                 std::string &data) {
+  BbvReader reader;
+  if (!reader.open(file_name)) return false;
+  if (reader.dims()) {
+    std::cerr << "Projected vectors are not BBVs" << std::endl;
+    return false;
+  }
+  BbvInterval interval;
+  while (reader.next(interval)) {
+    auto &entries = interval.entries;
+    std::sort(
+        entries.begin(), entries.end(),
+        [](const BbvEntry &a, const BbvEntry &b) { return a.id < b.id; });
+    encoder.begin(data, interval.index);
+    for (const auto &entry : entries) encoder.add(data, entry.id, entry.count);
+    encoder.end(data);
+  }
+  return !reader.failed();
+}
+
+int main(int argc, char **argv) {
+  CodecOptions options = {CODEC_GZIP, CODEC_DEFAULT_LEVEL,
+                          Z_DEFAULT_STRATEGY, false, 1};
+  const char *codec_name = "gzip";
+  BbvFormat format = FORMAT_TEXT;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:l:t:f:b:k:n:z:s:h")) != -1) {
+    char *p = nullptr;
+    bool ok = true;
+    switch (opt) {
+      case 'c':
+        codec_name = optarg;
+        ok = parse_codec(optarg, options.codec);
+        break;
+      case 'l': {
+        long level = strtol(optarg, &p, 0);
+        options.level = level;
+        ok = options.level == level && level != CODEC_DEFAULT_LEVEL;
+        break;
+      }
+      case 't':
+        options.threads = strtol(optarg, &p, 0);
+        ok = options.threads > 0;
+        break;
+      case 'f':
+        ok = parse_format(optarg, format);
+        break;
+      case 'b':
+        num_blocks = strtoull(optarg, &p, 0);
+        ok = num_blocks != 0;
+        break;
+      case 'k':
+        execs_per_interval = strtoull(optarg, &p, 0);
+        break;
+      case 'n':
+        num_intervals = strtoull(optarg, &p, 0);
+        break;
+      case 'z':
+        zipf_exponent = strtod(optarg, &p);
+        break;
+      case 's':
+        seed = strtoull(optarg, &p, 0);
+        break;
+      default:
+        show_usage(argv[0]);
+        return opt != 'h';
+    }
+    if (!ok || (p && *p != '\0')) {
+      std::cerr << "Invalid argument of -" << static_cast<char>(opt) << ": "
+                << optarg << std::endl;
+      return 1;
+    }
+  }
+  if (optind + 1 < argc || !check_codec_options(options)) {
+    show_usage(argv[0]);
+    return 1;
+  }
+
+  IntervalEncoder encoder(format);
+  std::string data;
+  encoder.begin_file(data);
+  if (optind < argc) {
+    if (!load(argv[optind], encoder, data)) return 1;
+  } else {
+    generate(encoder, data);
+  }
+
+  /* compress to a temporary file, removed once its size is known */
+  const char *tmpdir = getenv("TMPDIR");
+  std::string file_name = std::string(tmpdir ? tmpdir : "/tmp") +
+                          "/bbvbench.XXXXXX";
+  int fd = mkstemp(&file_name[0]);
+  if (fd < 0) {
+    std::cerr << "Failed to create a temporary file" << std::endl;
+    return 1;
+  }
+  close(fd);
+
+  auto start = std::chrono::steady_clock::now();
+  OutputFile output;
+  bool ok = output.open(file_name, options);
+  /* in chunks of OUTPUT_FLUSH_SIZE, as by the plugin */
+  if (ok) ok = output.write(data.data(), data.size());
+  ok = output.close() && ok;
+  auto end = std::chrono::steady_clock::now();
+
+  struct stat st;
+  ok = stat(file_name.c_str(), &st) == 0 && ok;
+  unlink(file_name.c_str());
+  if (!ok) {
+    std::cerr << "Failed to compress to " << file_name << std::endl;
+    return 1;
+  }
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  std::cout << "{\"codec\": \"" << codec_name << "\", \"format\": \""
+            << (format == FORMAT_TEXT ? "text" : "binary")
+            << "\", \"level\": "
+            << (options.level == CODEC_DEFAULT_LEVEL
+                    ? "null"
+                    : std::to_string(options.level))
+            << ", \"threads\": " << options.threads
+            << ", \"input_bytes\": " << data.size()
+            << ", \"output_bytes\": " << st.st_size
+            << ", \"ratio\": " << static_cast<double>(data.size()) / st.st_size
+            << ", \"mb_per_s\": " << data.size() / seconds / 1e6 << "}"
+            << std::endl;
+  return 0;
+}
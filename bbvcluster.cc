@@ -0,0 +1,349 @@
+/*
+ * Pick simulation points from a BBV file like SimPoint 3.2: vectors are
+ * normalized and randomly projected, clustered by k-means for every k with
+ * several random initializations, and the smallest k whose BIC score is
+ * close enough to the best is chosen. The k-means runs are spread over a
+ * pool of threads.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "projection.h"
+#include "reader.h"
+
+/* Projected vectors are padded to a multiple of this for SIMD */
+#define VECTOR_ALIGN 8
+
+/* Options, named after those of SimPoint */
+static unsigned max_k = 10;
+static unsigned dims = PROJECT_DIMS;
+static unsigned num_init_seeds = 5;
+static unsigned max_iters = 100;
+static double bic_threshold = 0.9;
+static unsigned num_threads;
+static uint64_t seed = 493575226;
+
+/* Projected vectors, stride floats each */
+static size_t num_points;
+static size_t stride;
+static std::vector<float> points;
+static std::vector<uint64_t> point_index; /* interval index of points */
+
+struct Clustering {
+  std::vector<float> centers; /* k vectors */
+  std::vector<uint32_t> labels;
+  double distortion;
+};
+
+static void show_usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] [<input>]" << std::endl;
+  std::cerr << "Pick simulation points from a BBV file, or a file of "
+               "projected vectors."
+            << std::endl;
+  std::cerr << "Input is a plain or gzipped file, or stdin if omitted or '-'."
+            << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -o <prefix>     write <prefix>.simpts and <prefix>.weights, "
+               "trace by default"
+            << std::endl;
+  std::cerr << "  -k <max k>      maximum number of clusters, 10 by default"
+            << std::endl;
+  std::cerr << "  -d <dims>       dimensions of the random projection of "
+               "BBVs, 15 by default"
+            << std::endl;
+  std::cerr << "  -n <seeds>      k-means initializations per k, 5 by default"
+            << std::endl;
+  std::cerr << "  -i <iters>      maximum k-means iterations, 100 by default"
+            << std::endl;
+  std::cerr << "  -b <threshold>  BIC threshold, 0.9 by default" << std::endl;
+  std::cerr << "  -s <seed>       seed of k-means initialization" << std::endl;
+  std::cerr << "  -j <threads>    number of threads, all CPUs by default"
+            << std::endl;
+}
+
+static bool parse_uint(const char *str, unsigned &value) {
+  char *p;
+  auto v = strtoul(str, &p, 0);
+  if (*p != '\0' || !v || v > UINT32_MAX) return false;
+  value = v;
+  return true;
+}
+
+/*
+ * Read, normalize and project all intervals. Files of projected vectors
+ * are used as is.
+ */
+static bool load_points(const char *file_name) {
+  BbvReader reader;
+  if (!reader.open(file_name)) return false;
+  if (reader.dims()) dims = reader.dims();
+  stride = (dims + VECTOR_ALIGN - 1) / VECTOR_ALIGN * VECTOR_ALIGN;
+
+  Projection projection(dims);
+  std::vector<double> vec(dims);
+  BbvInterval interval;
+  while (reader.next(interval)) {
+    if (reader.dims()) {
+      if (!interval.insns) continue;
+      points.insert(points.end(), interval.projected.begin(),
+                    interval.projected.end());
+      points.resize(points.size() + stride - dims);
+      point_index.push_back(interval.index);
+      continue;
+    }
+    double total = 0;
+    for (const auto &entry : interval.entries) total += entry.count;
+    if (total == 0) continue;
+    std::fill(vec.begin(), vec.end(), 0.0);
+    for (const auto &entry : interval.entries) {
+      projection.add(vec.data(), entry.id, entry.count / total);
+    }
+    points.insert(points.end(), vec.begin(), vec.end());
+    points.resize(points.size() + stride - dims);
+    point_index.push_back(interval.index);
+  }
+  num_points = point_index.size();
+  return !reader.failed();
+}
+
+/*
+ * Squared distance of two vectors. Partial sums are kept per lane, so the
+ * loop vectorizes without reordering float additions.
+ */
+static inline float distance(const float *a, const float *b) {
+  float sums[VECTOR_ALIGN] = {};
+  for (size_t i = 0; i < stride; i += VECTOR_ALIGN) {
+    for (size_t j = 0; j < VECTOR_ALIGN; ++j) {
+      float d = a[i + j] - b[i + j];
+      sums[j] += d * d;
+    }
+  }
+  float sum = 0;
+  for (size_t j = 0; j < VECTOR_ALIGN; ++j) sum += sums[j];
+  return sum;
+}
+
+static void kmeans(unsigned k, unsigned run, Clustering &result) {
+  /* initialize with distinct random points, independent of scheduling */
+  std::mt19937_64 rng(seed ^ (uint64_t(k) << 32 | run));
+  std::vector<size_t> samples(num_points);
+  for (size_t i = 0; i < num_points; ++i) samples[i] = i;
+  auto &centers = result.centers;
+  centers.assign(k * stride, 0);
+  for (unsigned c = 0; c < k; ++c) {
+    std::uniform_int_distribution<size_t> dist(c, num_points - 1);
+    std::swap(samples[c], samples[dist(rng)]);
+    memcpy(&centers[c * stride], &points[samples[c] * stride],
+           sizeof(float) * stride);
+  }
+
+  auto &labels = result.labels;
+  labels.assign(num_points, UINT32_MAX);
+  std::vector<double> sums(k * stride);
+  std::vector<size_t> sizes(k);
+  for (unsigned iter = 0; iter < max_iters; ++iter) {
+    bool changed = false;
+    result.distortion = 0;
+    for (size_t i = 0; i < num_points; ++i) {
+      auto point = &points[i * stride];
+      uint32_t best = 0;
+      float best_dist = distance(point, &centers[0]);
+      for (unsigned c = 1; c < k; ++c) {
+        float dist = distance(point, &centers[c * stride]);
+        if (dist < best_dist) {
+          best = c;
+          best_dist = dist;
+        }
+      }
+      if (labels[i] != best) {
+        labels[i] = best;
+        changed = true;
+      }
+      result.distortion += best_dist;
+    }
+    if (!changed) break;
+
+    std::fill(sums.begin(), sums.end(), 0.0);
+    std::fill(sizes.begin(), sizes.end(), 0);
+    for (size_t i = 0; i < num_points; ++i) {
+      auto sum = &sums[labels[i] * stride];
+      auto point = &points[i * stride];
+      for (size_t j = 0; j < stride; ++j) sum[j] += point[j];
+      sizes[labels[i]]++;
+    }
+    /* empty clusters keep their centers */
+    for (unsigned c = 0; c < k; ++c) {
+      if (!sizes[c]) continue;
+      for (size_t j = 0; j < stride; ++j) {
+        centers[c * stride + j] = sums[c * stride + j] / sizes[c];
+      }
+    }
+  }
+}
+
+/* Bayesian information criterion of a clustering, as in X-means */
+static double bic(unsigned k, const Clustering &clustering) {
+  std::vector<size_t> sizes(k);
+  for (auto label : clustering.labels) sizes[label]++;
+
+  double r = num_points;
+  double variance = num_points > k ? clustering.distortion / (r - k) : 0;
+  variance = std::max(variance, std::numeric_limits<double>::min());
+  double loglik = 0;
+  for (auto size : sizes) {
+    if (!size) continue;
+    double rn = size;
+    loglik += rn * log(rn) - rn * log(r) - rn / 2 * log(2 * M_PI) -
+              rn * dims / 2 * log(variance) - (rn - k) / 2;
+  }
+  double params = (k - 1) + dims * k + 1;
+  return loglik - params / 2 * log(r);
+}
+
+/* Run all initializations of all k, keeping the best of each k */
+static std::vector<Clustering> cluster_all(unsigned ks) {
+  std::vector<Clustering> runs(ks * num_init_seeds);
+  std::atomic<unsigned> next_run{0};
+  auto worker = [&]() {
+    for (unsigned i; (i = next_run++) < runs.size();) {
+      kmeans(i / num_init_seeds + 1, i % num_init_seeds, runs[i]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i) threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads) thread.join();
+
+  std::vector<Clustering> best(ks);
+  for (unsigned k = 0; k < ks; ++k) {
+    auto first = runs.begin() + k * num_init_seeds;
+    auto it = std::min_element(first, first + num_init_seeds,
+                               [](const Clustering &a, const Clustering &b) {
+                                 return a.distortion < b.distortion;
+                               });
+    best[k] = std::move(*it);
+  }
+  return best;
+}
+
+/* Write the interval closest to the center of every cluster, and sizes */
+static bool write_simpoints(const std::string &prefix, unsigned k,
+                            const Clustering &clustering) {
+  std::vector<size_t> closest(k, SIZE_MAX), sizes(k);
+  std::vector<float> closest_dist(k);
+  for (size_t i = 0; i < num_points; ++i) {
+    auto label = clustering.labels[i];
+    float dist = distance(&points[i * stride],
+                          &clustering.centers[label * stride]);
+    if (closest[label] == SIZE_MAX || dist < closest_dist[label]) {
+      closest[label] = i;
+      closest_dist[label] = dist;
+    }
+    sizes[label]++;
+  }
+
+  std::ofstream simpts(prefix + ".simpts"), weights(prefix + ".weights");
+  unsigned id = 0;
+  for (unsigned c = 0; c < k; ++c) {
+    if (!sizes[c]) continue;
+    simpts << point_index[closest[c]] << " " << id << "\n";
+    weights << static_cast<double>(sizes[c]) / num_points << " " << id
+            << "\n";
+    id++;
+  }
+  simpts.close();
+  weights.close();
+  return simpts && weights;
+}
+
+int main(int argc, char **argv) {
+  std::string prefix("trace");
+  num_threads = std::max(1u, std::thread::hardware_concurrency());
+  int opt;
+  while ((opt = getopt(argc, argv, "o:k:d:n:i:b:s:j:h")) != -1) {
+    bool ok = true;
+    switch (opt) {
+      case 'o':
+        prefix = optarg;
+        break;
+      case 'k':
+        ok = parse_uint(optarg, max_k);
+        break;
+      case 'd':
+        ok = parse_uint(optarg, dims);
+        break;
+      case 'n':
+        ok = parse_uint(optarg, num_init_seeds);
+        break;
+      case 'i':
+        ok = parse_uint(optarg, max_iters);
+        break;
+      case 'b': {
+        char *p;
+        bic_threshold = strtod(optarg, &p);
+        ok = *p == '\0' && bic_threshold >= 0 && bic_threshold <= 1;
+        break;
+      }
+      case 's': {
+        char *p;
+        seed = strtoull(optarg, &p, 0);
+        ok = *p == '\0';
+        break;
+      }
+      case 'j':
+        ok = parse_uint(optarg, num_threads);
+        break;
+      default:
+        show_usage(argv[0]);
+        return opt != 'h';
+    }
+    if (!ok) {
+      std::cerr << "Invalid argument of -" << static_cast<char>(opt) << ": "
+                << optarg << std::endl;
+      return 1;
+    }
+  }
+  if (optind + 1 < argc) {
+    show_usage(argv[0]);
+    return 1;
+  }
+
+  if (!load_points(optind < argc ? argv[optind] : "-")) return 1;
+  if (!num_points) {
+    std::cerr << "No intervals to cluster" << std::endl;
+    return 1;
+  }
+
+  unsigned ks = std::min<size_t>(max_k, num_points);
+  auto clusterings = cluster_all(ks);
+
+  /* the smallest k scoring above the threshold between the extremes */
+  std::vector<double> scores(ks);
+  for (unsigned k = 0; k < ks; ++k) scores[k] = bic(k + 1, clusterings[k]);
+  auto minmax = std::minmax_element(scores.begin(), scores.end());
+  double limit =
+      *minmax.first + bic_threshold * (*minmax.second - *minmax.first);
+  unsigned k = 0;
+  while (scores[k] < limit) k++;
+
+  std::cerr << "Clustered " << num_points << " intervals, k = " << k + 1
+            << std::endl;
+  if (!write_simpoints(prefix, k + 1, clusterings[k])) {
+    std::cerr << "Failed to write simulation points: " << prefix << std::endl;
+    return 1;
+  }
+  return 0;
+}
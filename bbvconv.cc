@@ -0,0 +1,87 @@
+/*
+ * Convert BBV files between the binary format of the plugin and SimPoint
+ * text, streaming one interval at a time.
+ */
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "format.h"
+#include "output.h"
+#include "reader.h"
+
+static void show_usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] [<input>]" << std::endl;
+  std::cerr << "Convert a BBV file, binary to SimPoint text by default."
+            << std::endl;
+  std::cerr << "Input is a plain or gzipped file, or stdin if omitted or '-'."
+            << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -o <output>       output file, stdout by default, "
+               "compressed by its suffix"
+            << std::endl;
+  std::cerr << "  -f text|binary    output format, text by default"
+            << std::endl;
+}
+
+int main(int argc, char **argv) {
+  std::string output_name("-");
+  BbvFormat format = FORMAT_TEXT;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:f:h")) != -1) {
+    switch (opt) {
+      case 'o':
+        output_name = optarg;
+        break;
+      case 'f':
+        if (!parse_format(optarg, format)) {
+          std::cerr << "Invalid format: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      default:
+        show_usage(argv[0]);
+        return opt != 'h';
+    }
+  }
+  if (optind + 1 < argc) {
+    show_usage(argv[0]);
+    return 1;
+  }
+
+  BbvReader reader;
+  if (!reader.open(optind < argc ? argv[optind] : "-")) return 1;
+  if (reader.dims()) {
+    std::cerr << "Projected vectors can not be converted to BBVs" << std::endl;
+    return 1;
+  }
+
+  OutputFile output;
+  if (!output.open(output_name)) return 1;
+
+  IntervalEncoder interval_encoder(format);
+  BbvInterval interval;
+  auto &buf = output.buf;
+  bool ok = true;
+  interval_encoder.begin_file(buf);
+  while (ok && reader.next(interval)) {
+    auto &entries = interval.entries;
+    /* binary records require ascending ids */
+    if (format == FORMAT_BINARY) {
+      std::sort(
+          entries.begin(), entries.end(),
+          [](const BbvEntry &a, const BbvEntry &b) { return a.id < b.id; });
+    }
+    interval_encoder.begin(buf, interval.index);
+    for (const auto &entry : entries) {
+      interval_encoder.add(buf, entry.id, entry.count);
+    }
+    interval_encoder.end(buf);
+    ok = output.flush();
+  }
+  ok = output.close() && ok;
+  return !ok || reader.failed();
+}
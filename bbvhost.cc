@@ -0,0 +1,741 @@
+/*
+ * Mock QEMU plugin host, to benchmark libbbv.so without QEMU or a guest.
+ *
+ * The part of the plugin API used by bbv.cc is implemented here, for the
+ * API version of the qemu-plugin.h it is built with. TBs are translated
+ * once, which runs the translation callback of the plugin, and then every
+ * execution runs the registered ops in the order QEMU emits them. A stream
+ * of blocks is either synthetic, with Zipf distributed hotness and
+ * checkpoints every few blocks, or replayed from a block trace.
+ *
+ * Besides the whole run, the time of translations, retranslations after TB
+ * flushes and checkpoints is measured, which is where the plugin looks up
+ * blocks and dumps intervals.
+ */
+
+extern "C" {
+#include "qemu-plugin.h"
+}
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "reader.h"
+#include "trace.h"
+
+/* Kernel TBs around checkpoints, user TBs are below MEM_START */
+#ifndef MEM_START
+#define MEM_START 0x80000000
+#endif
+#define KERNEL_ENTRY (MEM_START + 0x100)
+#define KERNEL_EXIT (MEM_START + 0x200)
+
+/* Number of blocks generated ahead for each vCPU and replayed in a loop */
+#define STREAM_LEN (1 << 20)
+
+enum OpKind {
+  OP_INLINE,
+  OP_CALLBACK,
+  OP_COND_CALLBACK,
+};
+
+struct Op {
+  OpKind kind;
+  uint64_t *ptr; /* inline ops before API v2 */
+#if QEMU_PLUGIN_VERSION >= 2
+  qemu_plugin_u64 entry;
+#endif
+#if QEMU_PLUGIN_VERSION >= 3
+  enum qemu_plugin_cond cond;
+#endif
+  uint64_t imm;
+  qemu_plugin_vcpu_udata_cb_t cb;
+  void *udata;
+};
+
+struct qemu_plugin_tb {
+  uint64_t vaddr;
+  size_t n_insns;
+  std::vector<Op> ops;
+};
+
+struct qemu_plugin_scoreboard {
+  size_t element_size;
+  std::vector<uint64_t> data;
+};
+
+/* A block of the stream, translated on its first execution */
+struct Block {
+  uint64_t pc;
+  size_t insns;
+  std::atomic<qemu_plugin_tb *> tb;
+  bool translated; /* translated before, even if flushed since */
+};
+
+static const qemu_plugin_id_t plugin_id = 1;
+static qemu_plugin_vcpu_tb_trans_cb_t trans_cb;
+static qemu_plugin_udata_cb_t atexit_cb;
+static void *atexit_udata;
+static unsigned num_vcpus = 1;
+
+static Block *blocks;
+static size_t ckpt_block;     /* index of the first kernel block */
+static std::mutex trans_lock; /* translation is serialized as in QEMU */
+
+/* Time spent in the plugin on translations and checkpoints */
+static uint64_t translations, trans_ns;
+static uint64_t retranslations, retrans_ns;
+static std::atomic<uint64_t> ckpt_ns{0};
+
+/*
+ * A reset requested by the plugin, done once all running vCPUs stopped
+ * after their current block, like the exclusive work of QEMU.
+ */
+static std::atomic<bool> reset_pending{false};
+static qemu_plugin_simple_cb_t reset_cb;
+static std::mutex reset_lock;
+static std::condition_variable reset_cond;
+static unsigned running_vcpus, reset_waiting;
+static uint64_t reset_gen;
+
+static inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+extern "C" {
+
+void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
+                                           qemu_plugin_vcpu_tb_trans_cb_t cb) {
+  trans_cb = cb;
+}
+
+void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
+                                    qemu_plugin_udata_cb_t cb,
+                                    void *userdata) {
+  atexit_cb = cb;
+  atexit_udata = userdata;
+}
+
+void qemu_plugin_reset(qemu_plugin_id_t id, qemu_plugin_simple_cb_t cb) {
+  std::lock_guard<std::mutex> guard(reset_lock);
+  reset_cb = cb;
+  reset_pending.store(true, std::memory_order_release);
+}
+
+void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
+                                          qemu_plugin_vcpu_udata_cb_t cb,
+                                          enum qemu_plugin_cb_flags flags,
+                                          void *userdata) {
+  Op op = {};
+  op.kind = OP_CALLBACK;
+  op.cb = cb;
+  op.udata = userdata;
+#if QEMU_PLUGIN_VERSION >= 2
+  tb->ops.push_back(op);
+#else
+  /* exec callbacks were emitted before inline ops */
+  auto it = std::find_if(tb->ops.begin(), tb->ops.end(),
+                         [](const Op &o) { return o.kind == OP_INLINE; });
+  tb->ops.insert(it, op);
+#endif
+}
+
+size_t qemu_plugin_tb_n_insns(const struct qemu_plugin_tb *tb) {
+  return tb->n_insns;
+}
+
+uint64_t qemu_plugin_tb_vaddr(const struct qemu_plugin_tb *tb) {
+  return tb->vaddr;
+}
+
+#if QEMU_PLUGIN_VERSION >= 2
+void qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+    struct qemu_plugin_tb *tb, enum qemu_plugin_op op, qemu_plugin_u64 entry,
+    uint64_t imm) {
+  Op o = {};
+  o.kind = OP_INLINE;
+  o.entry = entry;
+  o.imm = imm;
+  tb->ops.push_back(o);
+}
+
+int qemu_plugin_num_vcpus(void) { return num_vcpus; }
+
+struct qemu_plugin_scoreboard *qemu_plugin_scoreboard_new(
+    size_t element_size) {
+  auto score = new qemu_plugin_scoreboard;
+  score->element_size = element_size;
+  score->data.resize(
+      (element_size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * num_vcpus);
+  return score;
+}
+
+void qemu_plugin_scoreboard_free(struct qemu_plugin_scoreboard *score) {
+  delete score;
+}
+
+void *qemu_plugin_scoreboard_find(struct qemu_plugin_scoreboard *score,
+                                  unsigned int vcpu_index) {
+  return reinterpret_cast<char *>(score->data.data()) +
+         score->element_size * vcpu_index;
+}
+
+static inline uint64_t *u64_ptr(qemu_plugin_u64 entry,
+                                unsigned int vcpu_index) {
+  return reinterpret_cast<uint64_t *>(
+      static_cast<char *>(qemu_plugin_scoreboard_find(entry.score,
+                                                       vcpu_index)) +
+      entry.offset);
+}
+
+uint64_t qemu_plugin_u64_get(qemu_plugin_u64 entry, unsigned int vcpu_index) {
+  return *u64_ptr(entry, vcpu_index);
+}
+
+void qemu_plugin_u64_set(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t val) {
+  *u64_ptr(entry, vcpu_index) = val;
+}
+
+uint64_t qemu_plugin_u64_sum(qemu_plugin_u64 entry) {
+  uint64_t sum = 0;
+  for (unsigned i = 0; i < num_vcpus; ++i) sum += *u64_ptr(entry, i);
+  return sum;
+}
+#else
+void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
+                                              enum qemu_plugin_op op,
+                                              void *ptr, uint64_t imm) {
+  Op o = {};
+  o.kind = OP_INLINE;
+  o.ptr = static_cast<uint64_t *>(ptr);
+  o.imm = imm;
+  tb->ops.push_back(o);
+}
+#endif
+
+#if QEMU_PLUGIN_VERSION >= 3
+void qemu_plugin_register_vcpu_tb_exec_cond_cb(
+    struct qemu_plugin_tb *tb, qemu_plugin_vcpu_udata_cb_t cb,
+    enum qemu_plugin_cb_flags flags, enum qemu_plugin_cond cond,
+    qemu_plugin_u64 entry, uint64_t imm, void *userdata) {
+  Op o = {};
+  o.kind = OP_COND_CALLBACK;
+  o.entry = entry;
+  o.cond = cond;
+  o.imm = imm;
+  o.cb = cb;
+  o.udata = userdata;
+  tb->ops.push_back(o);
+}
+
+static bool check_cond(enum qemu_plugin_cond cond, uint64_t a, uint64_t b) {
+  switch (cond) {
+    case QEMU_PLUGIN_COND_ALWAYS:
+      return true;
+    case QEMU_PLUGIN_COND_EQ:
+      return a == b;
+    case QEMU_PLUGIN_COND_NE:
+      return a != b;
+    case QEMU_PLUGIN_COND_LT:
+      return a < b;
+    case QEMU_PLUGIN_COND_LE:
+      return a <= b;
+    case QEMU_PLUGIN_COND_GT:
+      return a > b;
+    case QEMU_PLUGIN_COND_GE:
+      return a >= b;
+    default:
+      return false;
+  }
+}
+#endif
+
+}  // extern "C"
+
+static qemu_plugin_tb *translate(Block &block) {
+  std::lock_guard<std::mutex> guard(trans_lock);
+  auto tb = block.tb.load(std::memory_order_acquire);
+  if (!tb) {
+    tb = new qemu_plugin_tb;
+    tb->vaddr = block.pc;
+    tb->n_insns = block.insns;
+    auto start = now_ns();
+    if (trans_cb) trans_cb(plugin_id, tb);
+    auto ns = now_ns() - start;
+    if (block.translated) {
+      retranslations++;
+      retrans_ns += ns;
+    } else {
+      translations++;
+      trans_ns += ns;
+      block.translated = true;
+    }
+    block.tb.store(tb, std::memory_order_release);
+  }
+  return tb;
+}
+
+static inline void exec_block(Block &block, unsigned int vcpu) {
+  auto tb = block.tb.load(std::memory_order_acquire);
+  if (!tb) tb = translate(block);
+  for (const auto &op : tb->ops) {
+    switch (op.kind) {
+      case OP_INLINE:
+#if QEMU_PLUGIN_VERSION >= 2
+        *u64_ptr(op.entry, vcpu) += op.imm;
+#else
+        /* shared by all vCPUs, and racy as in QEMU */
+        *op.ptr += op.imm;
+#endif
+        break;
+      case OP_CALLBACK:
+        op.cb(vcpu, op.udata);
+        break;
+      case OP_COND_CALLBACK:
+#if QEMU_PLUGIN_VERSION >= 3
+        if (check_cond(op.cond, *u64_ptr(op.entry, vcpu), op.imm)) {
+          op.cb(vcpu, op.udata);
+        }
+#endif
+        break;
+    }
+  }
+}
+
+/* The kernel entry, the checkpoint function and the kernel exit */
+static void exec_ckpt(unsigned int vcpu) {
+  for (size_t i = ckpt_block; i < ckpt_block + 4; ++i) {
+    exec_block(blocks[i], vcpu);
+  }
+}
+
+/*
+ * Time a checkpoint until the end of the next user block, which is where
+ * the interval is dumped with conditional callbacks.
+ */
+static inline void end_ckpt_timing(uint64_t &start) {
+  if (!start) return;
+  ckpt_ns.fetch_add(now_ns() - start, std::memory_order_relaxed);
+  start = 0;
+}
+
+/*
+ * Drop all TBs, so blocks are translated again as after a full code cache.
+ * QEMU flushes with all vCPUs stopped, so this is only done with one vCPU.
+ */
+static void flush_tbs(size_t num_blocks) {
+  for (size_t i = 0; i < num_blocks; ++i) {
+    delete blocks[i].tb.load(std::memory_order_relaxed);
+    blocks[i].tb.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+/* Reset the plugin, with reset_lock held and all other vCPUs waiting */
+static void finish_reset() {
+  trans_cb = nullptr;
+  atexit_cb = nullptr;
+  flush_tbs(ckpt_block + 4);
+  reset_cb(plugin_id);
+  reset_waiting = 0;
+  reset_gen++;
+  reset_pending.store(false, std::memory_order_release);
+  reset_cond.notify_all();
+}
+
+static void wait_reset() {
+  std::unique_lock<std::mutex> guard(reset_lock);
+  if (!reset_pending.load(std::memory_order_acquire)) return;
+  if (++reset_waiting < running_vcpus) {
+    auto gen = reset_gen;
+    reset_cond.wait(guard, [gen] { return reset_gen != gen; });
+  } else {
+    finish_reset();
+  }
+}
+
+/* Called by vCPUs between blocks */
+static inline void check_reset() {
+  if (reset_pending.load(std::memory_order_relaxed)) wait_reset();
+}
+
+/* Called by a vCPU at its end, which no longer takes part in resets */
+static void exit_vcpu() {
+  std::lock_guard<std::mutex> guard(reset_lock);
+  running_vcpus--;
+  if (reset_waiting && reset_waiting == running_vcpus) finish_reset();
+}
+
+static void alloc_blocks(size_t user_blocks, uint64_t ckpt_pc) {
+  /* addresses below MEM_START are offsets in the checkpoint function */
+  static const struct {
+    uint64_t pc;
+    size_t insns;
+  } kernel_blocks[4] = {
+      {KERNEL_ENTRY, 3}, {0, 4}, {0x20, 2}, {KERNEL_EXIT, 3}};
+
+  ckpt_block = user_blocks;
+  blocks = new Block[user_blocks + 4];
+  for (size_t i = 0; i < user_blocks + 4; ++i) {
+    blocks[i].tb.store(nullptr);
+    blocks[i].translated = false;
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    auto pc = kernel_blocks[i].pc;
+    blocks[ckpt_block + i].pc = pc < MEM_START ? ckpt_pc + pc : pc;
+    blocks[ckpt_block + i].insns = kernel_blocks[i].insns;
+  }
+}
+
+/* Options of synthetic streams */
+static uint64_t execs_per_vcpu = 10000000;
+static double zipf_exponent = 1.0;
+static uint64_t ckpt_every = 0; /* blocks between checkpoints, 0 for none */
+static uint64_t flush_every = 0; /* blocks between TB flushes, 0 for none */
+static uint64_t seed = 42;
+
+static void run_synthetic(unsigned int vcpu, const std::vector<uint32_t> &s) {
+  uint64_t next_ckpt = ckpt_every ? ckpt_every : UINT64_MAX;
+  uint64_t next_flush = flush_every ? flush_every : UINT64_MAX;
+  uint64_t ckpt_start = 0;
+  for (uint64_t i = 0; i < execs_per_vcpu; ++i) {
+    exec_block(blocks[s[i % STREAM_LEN]], vcpu);
+    end_ckpt_timing(ckpt_start);
+    check_reset();
+    if (i + 1 == next_flush) {
+      flush_tbs(ckpt_block + 4);
+      next_flush += flush_every;
+    }
+    if (i + 1 == next_ckpt) {
+      ckpt_start = now_ns();
+      exec_ckpt(vcpu);
+      check_reset();
+      next_ckpt += ckpt_every;
+    }
+  }
+  end_ckpt_timing(ckpt_start);
+  exit_vcpu();
+}
+
+/* Recorded executions of a trace */
+struct Exec {
+  uint32_t vcpu;
+  uint32_t id; /* 0 for a checkpoint */
+  uint64_t count;
+};
+
+static bool load_trace(const char *file_name, uint64_t ckpt_pc,
+                       std::vector<Exec> &execs) {
+  TraceReader reader;
+  if (!reader.open(file_name)) return false;
+  std::vector<std::pair<uint64_t, size_t>> defs;
+  TraceRecord record;
+  while (reader.next(record)) {
+    if (record.vcpu >= num_vcpus) {
+      std::cerr << "Trace uses vCPU " << record.vcpu << ", more than "
+                << num_vcpus << std::endl;
+      return false;
+    }
+    if (record.kind == TRACE_DEFINE) {
+      defs.push_back({record.pc, record.insns});
+    } else if (record.kind == TRACE_BLOCK) {
+      if (!record.id || record.id > defs.size()) {
+        std::cerr << "Undefined block: " << record.id << std::endl;
+        return false;
+      }
+      execs.push_back({static_cast<uint32_t>(record.vcpu),
+                       static_cast<uint32_t>(record.id), record.count});
+    } else {
+      execs.push_back({static_cast<uint32_t>(record.vcpu), 0, 0});
+    }
+  }
+  if (reader.failed()) return false;
+
+  alloc_blocks(defs.size(), ckpt_pc);
+  for (size_t i = 0; i < defs.size(); ++i) {
+    blocks[i].pc = defs[i].first;
+    blocks[i].insns = defs[i].second;
+  }
+  return true;
+}
+
+static void run_trace(const std::vector<Exec> &execs) {
+  std::vector<uint64_t> ckpt_start(num_vcpus);
+  for (const auto &exec : execs) {
+    if (!exec.id) {
+      ckpt_start[exec.vcpu] = now_ns();
+      exec_ckpt(exec.vcpu);
+      check_reset();
+      continue;
+    }
+    auto &block = blocks[exec.id - 1];
+    for (uint64_t i = 0; i < exec.count; ++i) {
+      exec_block(block, exec.vcpu);
+      end_ckpt_timing(ckpt_start[exec.vcpu]);
+      check_reset();
+    }
+  }
+  for (auto &start : ckpt_start) end_ckpt_timing(start);
+}
+
+static void show_usage(const char *prog) {
+  std::cerr << "Usage: " << prog
+            << " [options] <plugin> [<arg>[,<arg>...]...]" << std::endl;
+  std::cerr << "Run a QEMU plugin on a synthetic or recorded block stream."
+            << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -b <blocks>     distinct user blocks, 10000 by default"
+            << std::endl;
+  std::cerr << "  -n <execs>      blocks executed by each vCPU, "
+               "10000000 by default"
+            << std::endl;
+  std::cerr << "  -z <exponent>   Zipf exponent of block hotness, "
+               "1 by default"
+            << std::endl;
+  std::cerr << "  -k <blocks>     blocks between checkpoints, none by default"
+            << std::endl;
+  std::cerr << "  -f <blocks>     blocks between TB flushes, none by default"
+            << std::endl;
+  std::cerr << "  -v <vcpus>      vCPUs, each running in a thread, "
+               "1 by default"
+            << std::endl;
+  std::cerr << "  -c <pc>         address of the checkpoint function, "
+               "0x80001000 by default"
+            << std::endl;
+  std::cerr << "  -s <seed>       seed of synthetic streams" << std::endl;
+  std::cerr << "  -r <trace>      replay a block trace in one thread instead"
+            << std::endl;
+  std::cerr << "  -j              print results as JSON" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  size_t user_blocks = 10000;
+  uint64_t ckpt_pc = 0x80001000;
+  const char *trace_file = nullptr;
+  bool json = false;
+  int opt;
+  /* stop at the plugin, the arguments after it are for the plugin */
+  while ((opt = getopt(argc, argv, "+b:n:z:k:f:v:c:s:r:jh")) != -1) {
+    char *p = nullptr;
+    bool ok = true;
+    switch (opt) {
+      case 'b':
+        user_blocks = strtoull(optarg, &p, 0);
+        ok = user_blocks != 0;
+        break;
+      case 'n':
+        execs_per_vcpu = strtoull(optarg, &p, 0);
+        break;
+      case 'z':
+        zipf_exponent = strtod(optarg, &p);
+        break;
+      case 'k':
+        ckpt_every = strtoull(optarg, &p, 0);
+        break;
+      case 'f':
+        flush_every = strtoull(optarg, &p, 0);
+        break;
+      case 'v':
+        num_vcpus = strtoul(optarg, &p, 0);
+        ok = num_vcpus && num_vcpus <= TRACE_MAX_VCPUS;
+        break;
+      case 'c':
+        ckpt_pc = strtoull(optarg, &p, 0);
+        break;
+      case 's':
+        seed = strtoull(optarg, &p, 0);
+        break;
+      case 'r':
+        trace_file = optarg;
+        break;
+      case 'j':
+        json = true;
+        break;
+      default:
+        show_usage(argv[0]);
+        return opt != 'h';
+    }
+    if (!ok || (p && *p != '\0')) {
+      std::cerr << "Invalid argument of -" << static_cast<char>(opt) << ": "
+                << optarg << std::endl;
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    show_usage(argv[0]);
+    return 1;
+  }
+  if (flush_every && (num_vcpus > 1 || trace_file)) {
+    std::cerr << "TB flushes need a synthetic stream of one vCPU" << std::endl;
+    return 1;
+  }
+
+  /* QEMU splits plugin arguments at commas */
+  std::vector<std::string> args;
+  for (int i = optind + 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    for (size_t pos = 0, end; pos <= arg.size(); pos = end + 1) {
+      end = std::min(arg.find(',', pos), arg.size());
+      if (end > pos) args.push_back(arg.substr(pos, end - pos));
+    }
+  }
+  std::vector<char *> plugin_argv;
+  for (auto &arg : args) plugin_argv.push_back(&arg[0]);
+  uint64_t interval_len = 0;
+  for (auto &arg : args) {
+    if (!arg.compare(0, 9, "interval=")) {
+      interval_len = strtoull(arg.c_str() + 9, nullptr, 0);
+    }
+  }
+
+  /* prepare the stream before the plugin sees any block */
+  std::vector<Exec> execs;
+  std::vector<std::vector<uint32_t>> streams;
+  if (trace_file) {
+    if (!load_trace(trace_file, ckpt_pc, execs)) return 1;
+  } else {
+    alloc_blocks(user_blocks, ckpt_pc);
+    for (size_t i = 0; i < user_blocks; ++i) {
+      blocks[i].pc = 0x10000 + i * 0x40;
+      blocks[i].insns = 1 + i % 8;
+    }
+    std::vector<double> weights(user_blocks);
+    for (size_t i = 0; i < user_blocks; ++i) {
+      weights[i] = 1 / pow(i + 1, zipf_exponent);
+    }
+    std::discrete_distribution<uint32_t> zipf(weights.begin(),
+                                              weights.end());
+    for (unsigned i = 0; i < num_vcpus; ++i) {
+      std::mt19937_64 rng(seed + i);
+      streams.emplace_back(STREAM_LEN);
+      for (auto &block : streams.back()) block = zipf(rng);
+    }
+  }
+
+  auto lib = dlopen(argv[optind], RTLD_NOW);
+  if (!lib) {
+    std::cerr << dlerror() << std::endl;
+    return 1;
+  }
+  auto install = reinterpret_cast<decltype(&qemu_plugin_install)>(
+      dlsym(lib, "qemu_plugin_install"));
+  if (!install) {
+    std::cerr << "Not a QEMU plugin: " << argv[optind] << std::endl;
+    return 1;
+  }
+  qemu_info_t info = {};
+  info.target_name = "riscv64";
+  info.version.min = info.version.cur = QEMU_PLUGIN_VERSION;
+  info.system_emulation = true;
+  info.system.smp_vcpus = info.system.max_vcpus = num_vcpus;
+  if (install(plugin_id, &info, plugin_argv.size(), plugin_argv.data())) {
+    std::cerr << "Failed to install the plugin" << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  /* blocks of a trace are replayed by one thread */
+  running_vcpus = trace_file ? 1 : num_vcpus;
+  if (trace_file) {
+    run_trace(execs);
+  } else {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < num_vcpus; ++i) {
+      threads.emplace_back(run_synthetic, i, std::cref(streams[i]));
+    }
+    for (auto &thread : threads) thread.join();
+  }
+  auto run_end = std::chrono::steady_clock::now();
+  if (atexit_cb) atexit_cb(plugin_id, atexit_udata);
+  auto exit_end = std::chrono::steady_clock::now();
+
+  /* count what was executed, for the rates */
+  uint64_t user_execs = 0, user_insns = 0, ckpts = 0;
+  bool tail = false; /* whether user blocks follow the last checkpoint */
+  if (trace_file) {
+    for (const auto &exec : execs) {
+      if (!exec.id) {
+        ckpts++;
+        tail = false;
+        continue;
+      }
+      tail = true;
+      user_execs += exec.count;
+      user_insns += exec.count * blocks[exec.id - 1].insns;
+    }
+  } else {
+    user_execs = execs_per_vcpu * num_vcpus;
+    for (unsigned i = 0; i < num_vcpus; ++i) {
+      for (uint64_t j = 0; j < std::min<uint64_t>(execs_per_vcpu, STREAM_LEN);
+           ++j) {
+        uint64_t times = execs_per_vcpu / STREAM_LEN +
+                         (j < execs_per_vcpu % STREAM_LEN);
+        user_insns += times * blocks[streams[i][j]].insns;
+      }
+    }
+    if (ckpt_every) {
+      ckpts = execs_per_vcpu / ckpt_every * num_vcpus;
+      tail = execs_per_vcpu % ckpt_every != 0;
+    }
+  }
+  /*
+   * The first checkpoint only starts an interval, and the plugin writes the
+   * last, partial interval at exit.
+   */
+  uint64_t intervals;
+  if (interval_len) {
+    intervals = (user_insns + interval_len - 1) / interval_len;
+  } else {
+    intervals = ckpts ? ckpts - 1 + tail : 0;
+  }
+
+  double run_s = std::chrono::duration<double>(run_end - start).count();
+  double exit_s = std::chrono::duration<double>(exit_end - run_end).count();
+  double ns_per_block = run_s * 1e9 / std::max<uint64_t>(user_execs, 1);
+  double ns_per_trans = trans_ns / std::max<double>(translations, 1);
+  double ns_per_retrans = retrans_ns / std::max<double>(retranslations, 1);
+  double ns_per_ckpt = ckpt_ns / std::max<double>(ckpts, 1);
+  if (json) {
+    std::cout << "{\"blocks\": " << user_execs
+              << ", \"ns_per_block\": " << ns_per_block
+              << ", \"intervals\": " << intervals
+              << ", \"intervals_per_s\": " << intervals / run_s
+              << ", \"exit_ms\": " << exit_s * 1e3
+              << ", \"translations\": " << translations
+              << ", \"ns_per_translation\": " << ns_per_trans
+              << ", \"retranslations\": " << retranslations
+              << ", \"ns_per_retranslation\": " << ns_per_retrans
+              << ", \"checkpoints\": " << ckpts
+              << ", \"ns_per_checkpoint\": " << ns_per_ckpt << "}"
+              << std::endl;
+    return 0;
+  }
+  std::cout << "blocks " << user_execs << ", " << ns_per_block
+            << " ns/block, intervals " << intervals << ", "
+            << intervals / run_s << " intervals/s, exit " << exit_s * 1e3
+            << " ms" << std::endl;
+  std::cout << "translations " << translations << ", " << ns_per_trans
+            << " ns each, retranslations " << retranslations << ", "
+            << ns_per_retrans << " ns each" << std::endl;
+  if (ckpts) {
+    std::cout << "checkpoints " << ckpts << ", " << ns_per_ckpt << " ns each"
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Merge the BBV files of shards of a run into one, with the ids of blocks
+ * made consistent through the block dictionaries of the shards.
+ *
+ * Shards are ordered by their first interval, and their dictionaries are
+ * walked in that order, each by ascending id, giving the next id to every
+ * block not seen before. With ids=order shards, this matches the ids of a
+ * single ids=order run as long as execution is deterministic. Stable ids
+ * of ids=pc or ids=dict may be kept instead, if the shards agree on them.
+ */
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "blocks.h"
+#include "format.h"
+#include "output.h"
+#include "reader.h"
+
+struct Shard {
+  const char *bbv_file_name;
+  uint64_t first_interval;
+  std::vector<BlockDef> blocks;
+};
+
+struct BlockKey {
+  uint64_t pc;
+  uint64_t insns;
+
+  bool operator==(const BlockKey &other) const {
+    return pc == other.pc && insns == other.insns;
+  }
+};
+
+struct BlockKeyHash {
+  size_t operator()(const BlockKey &key) const {
+    return std::hash<uint64_t>()(key.pc ^ (key.insns << 48));
+  }
+};
+
+static void show_usage(const char *prog) {
+  std::cerr << "Usage: " << prog
+            << " [options] <bbv> <blocks> [<bbv> <blocks>...]" << std::endl;
+  std::cerr << "Merge the BBV files of shards, each with its block "
+               "dictionary, into one."
+            << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -o <output>       output file, stdout by default, "
+               "compressed by its suffix"
+            << std::endl;
+  std::cerr << "  -f text|binary    output format, text by default"
+            << std::endl;
+  std::cerr << "  -d <blocks>       write the merged block dictionary"
+            << std::endl;
+  std::cerr << "  -k                keep the ids of the shards" << std::endl;
+}
+
+typedef std::unordered_map<BlockKey, uint64_t, BlockKeyHash> IdsByBlock;
+
+/* Map the ids of a shard to merged ids, or check them if kept */
+static bool map_ids(const Shard &shard, bool keep, IdsByBlock &ids,
+                    std::unordered_map<uint64_t, BlockKey> &blocks,
+                    std::vector<BlockDef> &merged,
+                    std::unordered_map<uint64_t, uint64_t> &map) {
+  map.clear();
+  for (const auto &def : shard.blocks) {
+    BlockKey key = {def.pc, def.insns};
+    uint64_t id = keep ? def.id : merged.size() + 1;
+    auto result = ids.insert({key, id});
+    if (result.second) {
+      if (keep && !blocks.insert({id, key}).second) {
+        std::cerr << "Id " << id << " is given to different blocks"
+                  << std::endl;
+        return false;
+      }
+      merged.push_back({id, def.pc, def.insns});
+    } else if (keep && result.first->second != id) {
+      std::cerr << "Block at 0x" << std::hex << def.pc << std::dec
+                << " has different ids" << std::endl;
+      return false;
+    }
+    map[def.id] = result.first->second;
+  }
+  return true;
+}
+
+static bool write_merged_blocks(const std::string &file_name,
+                                uint64_t first_interval,
+                                const std::vector<BlockDef> &merged) {
+  std::string buf;
+  append_blocks_header(buf, first_interval);
+  for (const auto &def : merged) append_block_def(buf, def);
+  std::ofstream out(file_name, std::ios::binary);
+  out.write(buf.data(), buf.size());
+  out.close();
+  return static_cast<bool>(out);
+}
+
+int main(int argc, char **argv) {
+  std::string output_name("-"), blocks_output;
+  BbvFormat format = FORMAT_TEXT;
+  bool keep = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:f:d:kh")) != -1) {
+    switch (opt) {
+      case 'o':
+        output_name = optarg;
+        break;
+      case 'f':
+        if (!parse_format(optarg, format)) {
+          std::cerr << "Invalid format: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'd':
+        blocks_output = optarg;
+        break;
+      case 'k':
+        keep = true;
+        break;
+      default:
+        show_usage(argv[0]);
+        return opt != 'h';
+    }
+  }
+  if (optind == argc || (argc - optind) % 2) {
+    show_usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<Shard> shards;
+  for (int i = optind; i < argc; i += 2) {
+    Shard shard;
+    shard.bbv_file_name = argv[i];
+    if (!read_blocks(argv[i + 1], shard.first_interval, shard.blocks)) {
+      return 1;
+    }
+    shards.push_back(std::move(shard));
+  }
+  std::stable_sort(shards.begin(), shards.end(),
+                   [](const Shard &a, const Shard &b) {
+                     return a.first_interval < b.first_interval;
+                   });
+
+  OutputFile output;
+  if (!output.open(output_name)) return 1;
+
+  IdsByBlock ids;
+  std::unordered_map<uint64_t, BlockKey> blocks; /* by kept id */
+  std::unordered_map<uint64_t, uint64_t> map;    /* ids of a shard */
+  std::vector<BlockDef> merged;
+  IntervalEncoder interval_encoder(format);
+  BbvInterval interval;
+  auto &buf = output.buf;
+  bool ok = true;
+  uint64_t next_index = shards[0].first_interval;
+  interval_encoder.begin_file(buf);
+  for (const auto &shard : shards) {
+    BbvReader reader;
+    if (!reader.open(shard.bbv_file_name)) {
+      ok = false;
+      break;
+    }
+    if (reader.dims()) {
+      std::cerr << shard.bbv_file_name << ": projected vectors can not be "
+                << "merged" << std::endl;
+      ok = false;
+      break;
+    }
+    if (!map_ids(shard, keep, ids, blocks, merged, map)) {
+      ok = false;
+      break;
+    }
+    while (ok && reader.next(interval)) {
+      /* text files do not record the index */
+      uint64_t index = reader.binary() ? interval.index
+                                       : shard.first_interval + interval.index;
+      if (index != next_index) {
+        std::cerr << shard.bbv_file_name << ": interval " << index
+                  << (index < next_index ? " overlaps a previous shard"
+                                         : " follows a gap")
+                  << ", expected " << next_index << std::endl;
+        ok = false;
+        break;
+      }
+      next_index++;
+
+      auto &entries = interval.entries;
+      for (auto &entry : entries) {
+        auto it = map.find(entry.id);
+        entry.id = it != map.end() ? it->second : 0;
+        if (!entry.id) {
+          std::cerr << shard.bbv_file_name << ": block of interval " << index
+                    << " missing from the dictionary" << std::endl;
+          ok = false;
+          break;
+        }
+      }
+      if (!ok) break;
+      std::sort(
+          entries.begin(), entries.end(),
+          [](const BbvEntry &a, const BbvEntry &b) { return a.id < b.id; });
+      interval_encoder.begin(buf, index);
+      for (const auto &entry : entries) {
+        interval_encoder.add(buf, entry.id, entry.count);
+      }
+      interval_encoder.end(buf);
+      ok = output.flush();
+    }
+    if (!ok || reader.failed()) {
+      ok = false;
+      break;
+    }
+  }
+  ok = output.close() && ok;
+  if (!ok) {
+    std::cerr << "Failed to merge into " << output_name << std::endl;
+    return 1;
+  }
+
+  std::sort(merged.begin(), merged.end(),
+            [](const BlockDef &a, const BlockDef &b) { return a.id < b.id; });
+  if (!blocks_output.empty() &&
+      !write_merged_blocks(blocks_output, shards[0].first_interval, merged)) {
+    std::cerr << "Failed to write block dictionary: " << blocks_output
+              << std::endl;
+    return 1;
+  }
+  std::cerr << "Merged " << shards.size() << " shards, intervals "
+            << shards[0].first_interval << " to " << next_index - 1 << ", "
+            << merged.size() << " blocks" << std::endl;
+  return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Rebuild BBVs from a block trace of the plugin, with intervals given by
+ * checkpoints or instruction counts, optionally keeping only the blocks in
+ * an address range or renumbering them.
+ */
+
+#include <getopt.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "format.h"
+#include "output.h"
+#include "reader.h"
+#include "trace.h"
+
+struct Block {
+  uint64_t pc;
+  uint64_t insns;
+  uint64_t out_id; /* id in the output, 0 if not assigned yet */
+};
+
+/* Options */
+static uint64_t interval_len = 0; /* split by checkpoints if 0 */
+static uint64_t pc_start = 0, pc_end = UINT64_MAX;
+static bool renumber = false;
+
+static std::vector<Block> blocks;  /* indexed by id - 1 */
+static std::vector<uint64_t> sum;  /* indexed by output id - 1 */
+static std::vector<uint64_t> ids;  /* output ids of non-zero entries */
+static std::vector<uint64_t> insn_count; /* indexed by vCPU */
+static uint64_t next_out_id = 1;
+static uint64_t interval_num = 0;
+static bool executed = false; /* whether any block ran in this interval */
+
+static OutputFile output;
+static IntervalEncoder interval_encoder(FORMAT_TEXT);
+static bool ok = true;
+
+static void show_usage(const char *prog) {
+  std::cerr << "Usage: " << prog << " [options] [<input>]" << std::endl;
+  std::cerr << "Rebuild BBVs from a block trace." << std::endl;
+  std::cerr << "Input is a plain or gzipped file, or stdin if omitted or '-'."
+            << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  -o <output>       output file, stdout by default, "
+               "compressed by its suffix"
+            << std::endl;
+  std::cerr << "  -f text|binary    output format, text by default"
+            << std::endl;
+  std::cerr << "  -i <length>       intervals of user instructions per vCPU, "
+               "checkpoints by default"
+            << std::endl;
+  std::cerr << "  -r <start>:<end>  only count blocks starting in "
+               "[start, end)"
+            << std::endl;
+  std::cerr << "  -n                number blocks by their first execution "
+               "in the output"
+            << std::endl;
+}
+
+static bool parse_range(const char *str) {
+  char *p;
+  pc_start = strtoull(str, &p, 0);
+  if (*p != ':') return false;
+  pc_end = strtoull(p + 1, &p, 0);
+  return *p == '\0' && pc_start < pc_end;
+}
+
+static void dump_interval() {
+  interval_encoder.begin(output.buf, interval_num++);
+  std::sort(ids.begin(), ids.end());
+  for (auto id : ids) {
+    interval_encoder.add(output.buf, id, sum[id - 1]);
+    sum[id - 1] = 0;
+  }
+  interval_encoder.end(output.buf);
+  ids.clear();
+  executed = false;
+  if (ok) ok = output.flush();
+}
+
+static void count_block(Block &block, uint64_t id, uint64_t count) {
+  if (!block.out_id) block.out_id = renumber ? next_out_id++ : id;
+  auto out_id = block.out_id;
+  if (sum.size() < out_id) sum.resize(out_id);
+  if (!sum[out_id - 1]) ids.push_back(out_id);
+  sum[out_id - 1] += count * block.insns;
+}
+
+/* Count executions of a block, ending intervals as the plugin does */
+static void exec_block(uint64_t vcpu, uint64_t id, uint64_t count) {
+  auto &block = blocks[id - 1];
+  /* the last interval is written if any block ran, filtered or not */
+  executed = true;
+  if (block.pc < pc_start || block.pc >= pc_end) return;
+  if (!interval_len) {
+    count_block(block, id, count);
+    return;
+  }
+
+  if (insn_count.size() <= vcpu) insn_count.resize(vcpu + 1);
+  auto &insns = insn_count[vcpu];
+  while (count) {
+    /* a boundary is detected before a block is counted */
+    if (insns >= interval_len) {
+      dump_interval();
+      insns = 0;
+    }
+    uint64_t n = std::min(
+        count, (interval_len - insns + block.insns - 1) / block.insns);
+    count_block(block, id, n);
+    insns += n * block.insns;
+    count -= n;
+  }
+}
+
+int main(int argc, char **argv) {
+  std::string output_name("-");
+  BbvFormat format = FORMAT_TEXT;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:f:i:r:nh")) != -1) {
+    switch (opt) {
+      case 'o':
+        output_name = optarg;
+        break;
+      case 'f':
+        if (!parse_format(optarg, format)) {
+          std::cerr << "Invalid format: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'i': {
+        char *p;
+        interval_len = strtoull(optarg, &p, 0);
+        if (*p != '\0' || !interval_len) {
+          std::cerr << "Invalid interval length: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      }
+      case 'r':
+        if (!parse_range(optarg)) {
+          std::cerr << "Invalid address range: " << optarg << std::endl;
+          return 1;
+        }
+        break;
+      case 'n':
+        renumber = true;
+        break;
+      default:
+        show_usage(argv[0]);
+        return opt != 'h';
+    }
+  }
+  if (optind + 1 < argc) {
+    show_usage(argv[0]);
+    return 1;
+  }
+
+  TraceReader reader;
+  if (!reader.open(optind < argc ? argv[optind] : "-")) return 1;
+
+  if (!output.open(output_name)) return 1;
+  interval_encoder = IntervalEncoder(format);
+  interval_encoder.begin_file(output.buf);
+
+  /* the first checkpoint starts the first interval */
+  bool started = interval_len != 0;
+  TraceRecord record;
+  while (ok && reader.next(record)) {
+    if (record.kind == TRACE_DEFINE) {
+      /* ids are allocated in order */
+      if (record.id != blocks.size() + 1 || !record.insns) {
+        std::cerr << "Invalid block definition: " << record.id << std::endl;
+        ok = false;
+        break;
+      }
+      blocks.push_back({record.pc, record.insns, 0});
+    } else if (record.kind == TRACE_BLOCK) {
+      if (!record.id || record.id > blocks.size()) {
+        std::cerr << "Undefined block: " << record.id << std::endl;
+        ok = false;
+        break;
+      }
+      exec_block(record.vcpu, record.id, record.count);
+    } else if (!interval_len) {
+      if (started) {
+        dump_interval();
+      } else {
+        for (auto id : ids) sum[id - 1] = 0;
+        ids.clear();
+        executed = false;
+        started = true;
+      }
+    }
+  }
+  if (ok && started && executed) dump_interval();
+
+  ok = output.close() && ok;
+
+  if (!ok) std::cerr << "Failed to rebuild BBVs" << std::endl;
+  return !ok || reader.failed();
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Microbenchmarks of libbbv.so on bbvhost and of the codecs on bbvbench,
+# each case in its own process. Results are printed as JSON.
+#
+# Block lookups are measured by translations, after TB flushes for blocks
+# seen before, and interval dumps by checkpoints, with tables of various
+# sizes and intervals of various sparsity.
+
+HOST=${HOST:-./bbvhost}
+PLUGIN=${PLUGIN:-./libbbv.so}
+CODEC_BENCH=${CODEC_BENCH:-./bbvbench}
+CKPT_ARGS=ckpt_start=0x80001000,ckpt_len=0x40
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+first=1
+
+# Run a case, as run_case <name> <command>...
+run_case() {
+  name=$1
+  shift
+  echo "$name" >&2
+  if ! result=$("$@" 2>"$dir/log"); then
+    cat "$dir/log" >&2
+    echo "$name failed, skipped" >&2
+    return
+  fi
+  [ $first = 1 ] || echo ","
+  first=0
+  printf '    {"name": "%s", "result": %s}' "$name" "$result"
+}
+
+echo "{"
+echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null)\","
+echo "  \"cases\": ["
+
+# insertion and lookup versus the number of blocks
+for blocks in 1000 10000 100000 1000000; do
+  run_case "translate_$blocks" "$HOST" -j -z 0 -b $blocks -n 10000000 \
+    -f 2000000 "$PLUGIN" "$CKPT_ARGS,bbv_file=$dir/bbv.gz"
+done
+
+# interval dumps versus the number of blocks and executions per interval
+for blocks in 10000 1000000; do
+  for execs in 1000 100000; do
+    run_case "dump_${blocks}_$execs" "$HOST" -j -z 0 -b $blocks \
+      -n 20000000 -k $execs "$PLUGIN" "$CKPT_ARGS,bbv_file=$dir/bbv.gz"
+  done
+done
+
+# counting alone, and with fixed-length intervals
+run_case count "$HOST" -j -n 50000000 "$PLUGIN" \
+  "$CKPT_ARGS,bbv_file=$dir/bbv.gz"
+run_case interval "$HOST" -j -n 50000000 "$PLUGIN" \
+  "interval=1000000,bbv_file=$dir/bbv.gz"
+
+# codecs on the same BBVs, unavailable ones are skipped
+for codec in none gzip zstd lz4; do
+  for format in text binary; do
+    run_case "codec_${codec}_$format" "$CODEC_BENCH" -c $codec -f $format
+  done
+done
+
+echo
+echo "  ]"
+echo "}"
@@ -0,0 +1,62 @@
+/*
+ * Encoding of block dictionaries.
+ *
+ * A dictionary maps the ids of a BBV file to the blocks they count, so
+ * BBVs of separate runs, such as the shards of one run, can be merged with
+ * consistent ids. It is a text file starting with a header line
+ *
+ *   QPBLK <version> <first interval>
+ *
+ * where the first interval is the index of the first interval of the BBV
+ * file, which text BBVs do not record. Each block then has a line of
+ *
+ *   <id> <pc> <insns>
+ *
+ * with the pc in hex, in ascending order of id.
+ */
+
+#ifndef QPOINTS_BLOCKS_H_
+#define QPOINTS_BLOCKS_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "format.h"
+
+#define BLOCKS_VERSION 1
+static const char kBlocksMagic[] = "QPBLK";
+
+struct BlockDef {
+  uint64_t id;
+  uint64_t pc;
+  uint64_t insns;
+};
+
+static inline void append_blocks_header(std::string &buf,
+                                        uint64_t first_interval) {
+  char num[U64_MAX_DIGITS];
+  buf.append(kBlocksMagic, sizeof(kBlocksMagic) - 1);
+  buf.push_back(' ');
+  buf.append(num, format_u64(num, BLOCKS_VERSION));
+  buf.push_back(' ');
+  buf.append(num, format_u64(num, first_interval));
+  buf.push_back('\n');
+}
+
+static inline void append_block_def(std::string &buf, const BlockDef &def) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  char num[U64_MAX_DIGITS];
+  buf.append(num, format_u64(num, def.id));
+  buf.append(" 0x");
+  int shift = 60;
+  while (shift > 0 && !(def.pc >> shift)) shift -= 4;
+  for (; shift >= 0; shift -= 4) {
+    buf.push_back(kHexDigits[def.pc >> shift & 15]);
+  }
+  buf.push_back(' ');
+  buf.append(num, format_u64(num, def.insns));
+  buf.push_back('\n');
+}
+
+#endif  // QPOINTS_BLOCKS_H_
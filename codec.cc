@@ -0,0 +1,512 @@
+/*
+ * Output codecs of BBV files.
+ */
+
+#include "codec.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/* Size of the output buffers of zstd and lz4 */
+#define ENCODER_BUF_SIZE (256 * 1024)
+
+/* Input size of each gzip member compressed in parallel */
+#define PGZIP_BLOCK_SIZE (1024 * 1024)
+
+/* Fastest lz4 level, whose acceleration lz4 caps at 65537 */
+#define LZ4_MIN_LEVEL -65537
+
+void (*output_thread_hook)() = nullptr;
+
+namespace {
+
+class PlainEncoder : public Encoder {
+ public:
+  explicit PlainEncoder(FILE *file) : file_(file) {}
+
+  bool write(const void *data, size_t len) override {
+    return fwrite(data, 1, len, file_) == len;
+  }
+
+  bool close() override { return fclose(file_) == 0; }
+
+ private:
+  FILE *file_;
+};
+
+class GzipEncoder : public Encoder {
+ public:
+  explicit GzipEncoder(gzFile file) : file_(file) {}
+
+  bool write(const void *data, size_t len) override {
+    return gzwrite(file_, data, len) == static_cast<int>(len);
+  }
+
+  bool close() override { return gzclose(file_) == Z_OK; }
+
+ private:
+  gzFile file_;
+};
+
+/*
+ * Splits the input into blocks and deflates each one into an independent
+ * gzip member on a pool of threads, as pigz and BGZF do. Concatenated
+ * members form a standard gzip stream, which zlib's gzread, gunzip and
+ * SimPoint read as a whole.
+ */
+class ParallelGzipEncoder : public Encoder {
+ public:
+  ParallelGzipEncoder(FILE *file, const CodecOptions &options)
+      : file_(file),
+        level_(options.level == CODEC_DEFAULT_LEVEL ? Z_DEFAULT_COMPRESSION
+                                                    : options.level),
+        strategy_(options.strategy),
+        threads_(options.threads),
+        stopping_(false),
+        failed_(false) {
+    for (int i = 0; i < threads_; ++i) {
+      workers_.emplace_back(&ParallelGzipEncoder::run, this);
+    }
+  }
+
+  bool write(const void *data, size_t len) override {
+    auto input = static_cast<const char *>(data);
+    while (len) {
+      size_t n = PGZIP_BLOCK_SIZE - block_.size();
+      if (n > len) n = len;
+      block_.append(input, n);
+      input += n;
+      len -= n;
+      if (block_.size() == PGZIP_BLOCK_SIZE) submit();
+    }
+    return !failed_;
+  }
+
+  bool close() override {
+    if (!block_.empty()) submit();
+    write_done(0);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    work_cond_.notify_all();
+    for (auto &worker : workers_) worker.join();
+    return (fclose(file_) == 0) && !failed_;
+  }
+
+ private:
+  struct Job {
+    std::string input, output;
+    bool done, ok;
+  };
+
+  /* queue the current block, and keep at most two blocks per thread */
+  void submit() {
+    std::unique_ptr<Job> job(new Job);
+    job->input.swap(block_);
+    job->done = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_.push(job.get());
+      jobs_.push_back(std::move(job));
+    }
+    work_cond_.notify_one();
+    write_done(threads_ * 2);
+  }
+
+  /* write finished members in order until at most max_jobs are left */
+  void write_done(size_t max_jobs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!jobs_.empty()) {
+      auto &job = jobs_.front();
+      if (!job->done) {
+        if (jobs_.size() <= max_jobs) break;
+        done_cond_.wait(lock, [&job] { return job->done; });
+      }
+      auto &out = job->output;
+      if (!job->ok || fwrite(out.data(), 1, out.size(), file_) != out.size()) {
+        failed_ = true;
+      }
+      jobs_.pop_front();
+    }
+  }
+
+  void run() {
+    if (output_thread_hook) output_thread_hook();
+    for (;;) {
+      Job *job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cond_.wait(lock,
+                        [this] { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) break;
+        job = pending_.front();
+        pending_.pop();
+      }
+      bool ok = deflate_member(job->input, job->output);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job->ok = ok;
+        job->done = true;
+      }
+      done_cond_.notify_all();
+    }
+  }
+
+  bool deflate_member(const std::string &input, std::string &output) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    /* 16 + window bits for a gzip header and trailer */
+    if (deflateInit2(&zs, level_, Z_DEFLATED, 16 + MAX_WBITS, 8, strategy_) !=
+        Z_OK) {
+      return false;
+    }
+    output.resize(deflateBound(&zs, input.size()));
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(input.data()));
+    zs.avail_in = input.size();
+    zs.next_out = reinterpret_cast<Bytef *>(&output[0]);
+    zs.avail_out = output.size();
+    bool ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+    output.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ok;
+  }
+
+  FILE *file_;
+  int level_, strategy_, threads_;
+  std::string block_;
+  std::deque<std::unique_ptr<Job>> jobs_; /* in output order */
+  std::queue<Job *> pending_;             /* not yet taken by a worker */
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable work_cond_, done_cond_;
+  bool stopping_, failed_;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdEncoder : public Encoder {
+ public:
+  ZstdEncoder(FILE *file, ZSTD_CCtx *cctx)
+      : file_(file), cctx_(cctx), out_(ZSTD_CStreamOutSize()) {}
+
+  bool write(const void *data, size_t len) override {
+    ZSTD_inBuffer in = {data, len, 0};
+    while (in.pos < in.size) {
+      if (!compress(&in, ZSTD_e_continue)) return false;
+    }
+    return true;
+  }
+
+  bool close() override {
+    ZSTD_inBuffer in = {nullptr, 0, 0};
+    bool ok;
+    do {
+      ok = compress(&in, ZSTD_e_end);
+    } while (ok && remaining_);
+    ZSTD_freeCCtx(cctx_);
+    return (fclose(file_) == 0) && ok;
+  }
+
+ private:
+  bool compress(ZSTD_inBuffer *in, ZSTD_EndDirective mode) {
+    ZSTD_outBuffer out = {out_.data(), out_.size(), 0};
+    remaining_ = ZSTD_compressStream2(cctx_, &out, in, mode);
+    if (ZSTD_isError(remaining_)) return false;
+    return fwrite(out_.data(), 1, out.pos, file_) == out.pos;
+  }
+
+  FILE *file_;
+  ZSTD_CCtx *cctx_;
+  std::vector<char> out_;
+  size_t remaining_;
+};
+#endif
+
+#ifdef HAVE_LZ4
+class Lz4Encoder : public Encoder {
+ public:
+  Lz4Encoder(FILE *file, LZ4F_cctx *cctx, const LZ4F_preferences_t &prefs)
+      : file_(file), cctx_(cctx), prefs_(prefs), started_(false) {}
+
+  bool write(const void *data, size_t len) override {
+    if (!started_ && !begin()) return false;
+    auto input = static_cast<const char *>(data);
+    while (len) {
+      size_t n = len < ENCODER_BUF_SIZE ? len : ENCODER_BUF_SIZE;
+      reserve(LZ4F_compressBound(n, &prefs_));
+      size_t size =
+          LZ4F_compressUpdate(cctx_, out_.data(), out_.size(), input, n, NULL);
+      if (!flush(size)) return false;
+      input += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  bool close() override {
+    bool ok = started_ || begin();
+    if (ok) {
+      reserve(LZ4F_compressBound(0, &prefs_));
+      ok = flush(LZ4F_compressEnd(cctx_, out_.data(), out_.size(), NULL));
+    }
+    LZ4F_freeCompressionContext(cctx_);
+    return (fclose(file_) == 0) && ok;
+  }
+
+ private:
+  bool begin() {
+    started_ = true;
+    reserve(LZ4F_HEADER_SIZE_MAX);
+    return flush(LZ4F_compressBegin(cctx_, out_.data(), out_.size(), &prefs_));
+  }
+
+  void reserve(size_t size) {
+    if (out_.size() < size) out_.resize(size);
+  }
+
+  bool flush(size_t size) {
+    if (LZ4F_isError(size)) return false;
+    return fwrite(out_.data(), 1, size, file_) == size;
+  }
+
+  FILE *file_;
+  LZ4F_cctx *cctx_;
+  LZ4F_preferences_t prefs_;
+  bool started_;
+  std::vector<char> out_;
+};
+#endif
+
+}  // namespace
+
+bool parse_codec(const char *name, Codec &codec) {
+  if (!strcmp(name, "none")) {
+    codec = CODEC_NONE;
+  } else if (!strcmp(name, "gzip")) {
+    codec = CODEC_GZIP;
+  } else if (!strcmp(name, "zstd")) {
+#ifdef HAVE_ZSTD
+    codec = CODEC_ZSTD;
+#else
+    std::cerr << "zstd support is not compiled in" << std::endl;
+    return false;
+#endif
+  } else if (!strcmp(name, "lz4")) {
+#ifdef HAVE_LZ4
+    codec = CODEC_LZ4;
+#else
+    std::cerr << "lz4 support is not compiled in" << std::endl;
+    return false;
+#endif
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool parse_gzip_strategy(const char *name, int &strategy) {
+  if (!strcmp(name, "default")) {
+    strategy = Z_DEFAULT_STRATEGY;
+  } else if (!strcmp(name, "filtered")) {
+    strategy = Z_FILTERED;
+  } else if (!strcmp(name, "huffman")) {
+    strategy = Z_HUFFMAN_ONLY;
+  } else if (!strcmp(name, "rle")) {
+    strategy = Z_RLE;
+  } else if (!strcmp(name, "fixed")) {
+    strategy = Z_FIXED;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool check_codec_options(const CodecOptions &options) {
+  int min_level, max_level;
+  switch (options.codec) {
+    case CODEC_GZIP:
+      min_level = Z_NO_COMPRESSION;
+      max_level = Z_BEST_COMPRESSION;
+      break;
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+      min_level = ZSTD_minCLevel();
+      max_level = ZSTD_maxCLevel();
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+      min_level = LZ4_MIN_LEVEL;
+      max_level = LZ4F_compressionLevel_max();
+      break;
+#endif
+    default:
+      /* uncompressed files have no level */
+      min_level = max_level = CODEC_DEFAULT_LEVEL;
+      break;
+  }
+  if (options.level != CODEC_DEFAULT_LEVEL &&
+      (options.level < min_level || options.level > max_level)) {
+    std::cerr << "Invalid compression level: " << options.level << std::endl;
+    return false;
+  }
+  if (options.strategy != Z_DEFAULT_STRATEGY &&
+      options.codec != CODEC_GZIP) {
+    std::cerr << "Strategies are only supported by gzip" << std::endl;
+    return false;
+  }
+  if (options.long_mode && options.codec != CODEC_ZSTD) {
+    std::cerr << "Long distance matching is only supported by zstd"
+              << std::endl;
+    return false;
+  }
+  if (options.threads > 1 && options.codec != CODEC_GZIP) {
+    std::cerr << "Compression threads are only supported by gzip" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+const char *codec_suffix(Codec codec) {
+  switch (codec) {
+    case CODEC_GZIP:
+      return ".gz";
+    case CODEC_ZSTD:
+      return ".zst";
+    case CODEC_LZ4:
+      return ".lz4";
+    default:
+      return "";
+  }
+}
+
+bool codec_of_file(const std::string &file_name, Codec &codec) {
+  static const Codec codecs[] = {CODEC_GZIP, CODEC_ZSTD, CODEC_LZ4};
+  codec = CODEC_NONE;
+  for (auto known : codecs) {
+    std::string suffix(codec_suffix(known));
+    if (file_name.size() > suffix.size() &&
+        !file_name.compare(file_name.size() - suffix.size(), suffix.size(),
+                           suffix)) {
+      codec = known;
+      break;
+    }
+  }
+#ifndef HAVE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    std::cerr << file_name << ": zstd support is not compiled in" << std::endl;
+    return false;
+  }
+#endif
+#ifndef HAVE_LZ4
+  if (codec == CODEC_LZ4) {
+    std::cerr << file_name << ": lz4 support is not compiled in" << std::endl;
+    return false;
+  }
+#endif
+  return true;
+}
+
+static Encoder *open_gzip(const std::string &file_name,
+                          const CodecOptions &options) {
+  /* level and strategy are given through the mode string of gzopen */
+  std::string mode("wb");
+  if (options.level != CODEC_DEFAULT_LEVEL) {
+    mode += std::to_string(options.level);
+  }
+  switch (options.strategy) {
+    case Z_FILTERED:
+      mode += 'f';
+      break;
+    case Z_HUFFMAN_ONLY:
+      mode += 'h';
+      break;
+    case Z_RLE:
+      mode += 'R';
+      break;
+    case Z_FIXED:
+      mode += 'F';
+      break;
+  }
+  auto file = gzopen(file_name.c_str(), mode.c_str());
+  if (!file) return nullptr;
+  gzbuffer(file, ENCODER_BUF_SIZE);
+  return new GzipEncoder(file);
+}
+
+#ifdef HAVE_ZSTD
+static Encoder *open_zstd(FILE *file, const CodecOptions &options) {
+  auto cctx = ZSTD_createCCtx();
+  if (!cctx) return nullptr;
+  if (options.level != CODEC_DEFAULT_LEVEL) {
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, options.level);
+  }
+  if (options.long_mode) {
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+  }
+  return new ZstdEncoder(file, cctx);
+}
+#endif
+
+#ifdef HAVE_LZ4
+static Encoder *open_lz4(FILE *file, const CodecOptions &options) {
+  LZ4F_cctx *cctx;
+  if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION))) {
+    return nullptr;
+  }
+  LZ4F_preferences_t prefs;
+  memset(&prefs, 0, sizeof(prefs));
+  if (options.level != CODEC_DEFAULT_LEVEL) {
+    prefs.compressionLevel = options.level;
+  }
+  return new Lz4Encoder(file, cctx, prefs);
+}
+#endif
+
+Encoder *open_encoder(const std::string &file_name,
+                      const CodecOptions &options) {
+  if (options.codec == CODEC_GZIP && options.threads <= 1) {
+    return open_gzip(file_name, options);
+  }
+
+  auto file = fopen(file_name.c_str(), "wb");
+  if (!file) return nullptr;
+  Encoder *encoder = nullptr;
+  switch (options.codec) {
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD:
+      encoder = open_zstd(file, options);
+      break;
+#endif
+#ifdef HAVE_LZ4
+    case CODEC_LZ4:
+      encoder = open_lz4(file, options);
+      break;
+#endif
+    case CODEC_GZIP:
+      encoder = new ParallelGzipEncoder(file, options);
+      break;
+    default:
+      encoder = new PlainEncoder(file);
+      break;
+  }
+  if (!encoder) fclose(file);
+  return encoder;
+}
@@ -0,0 +1,63 @@
+/*
+ * Output codecs of BBV files.
+ */
+
+#ifndef QPOINTS_CODEC_H_
+#define QPOINTS_CODEC_H_
+
+#include <limits.h>
+#include <stddef.h>
+
+#include <string>
+
+enum Codec {
+  CODEC_NONE,
+  CODEC_GZIP,
+  CODEC_ZSTD,
+  CODEC_LZ4,
+};
+
+/* Level of the codec's default, zstd and lz4 take negative levels */
+#define CODEC_DEFAULT_LEVEL INT_MIN
+
+struct CodecOptions {
+  Codec codec;
+  int level;      /* compression level, or CODEC_DEFAULT_LEVEL */
+  int strategy;   /* zlib strategy, gzip only */
+  bool long_mode; /* long distance matching, zstd only */
+  int threads;    /* number of compression threads, gzip only */
+};
+
+/* Streaming compressor writing to a file */
+class Encoder {
+ public:
+  virtual ~Encoder() {}
+  virtual bool write(const void *data, size_t len) = 0;
+  /* Flush all pending data and close the file */
+  virtual bool close() = 0;
+};
+
+/*
+ * Called first by every thread writing or compressing output, if set, so
+ * the plugin can count their host performance counters.
+ */
+extern void (*output_thread_hook)();
+
+/* Parse a codec name, fails if the codec is unknown or not compiled in */
+bool parse_codec(const char *name, Codec &codec);
+/* Parse a zlib strategy name */
+bool parse_gzip_strategy(const char *name, int &strategy);
+/* Check if the options are valid for the codec */
+bool check_codec_options(const CodecOptions &options);
+/* File name suffix of a codec, e.g. ".gz" */
+const char *codec_suffix(Codec codec);
+/*
+ * Codec of a file by its suffix, uncompressed if unknown. Fails for the
+ * suffix of a codec that is not compiled in.
+ */
+bool codec_of_file(const std::string &file_name, Codec &codec);
+/* Create the file and return its encoder, nullptr on failure */
+Encoder *open_encoder(const std::string &file_name,
+                      const CodecOptions &options);
+
+#endif  // QPOINTS_CODEC_H_
@@ -0,0 +1,157 @@
+/*
+ * Encoding of BBV files.
+ *
+ * Text files use the SimPoint frequency vector format, one line per
+ * interval:
+ *
+ *   T :<id>:<count> :<id>:<count> ...
+ *
+ * Binary files start with an 8-byte header, the magic "QPBBV" followed by
+ * the version and two zero bytes. Each interval is then a record of LEB128
+ * varints:
+ *
+ *   <interval index> (<id delta> <count>)... 0
+ *
+ * Entries are sorted by id, and each id is stored as the difference from
+ * the previous one, starting from zero. Ids start from one, so a zero
+ * delta ends the record.
+ */
+
+#ifndef QPOINTS_FORMAT_H_
+#define QPOINTS_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+/* Maximum length of a formatted uint64_t */
+#define U64_MAX_DIGITS 20
+
+/* Maximum length of a LEB128 encoded uint64_t */
+#define VARINT_MAX_BYTES 10
+
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 8
+static const char kBinaryHeader[BINARY_HEADER_SIZE] = {
+    'Q', 'P', 'B', 'B', 'V', BINARY_VERSION, 0, 0};
+
+enum BbvFormat {
+  FORMAT_TEXT,
+  FORMAT_BINARY,
+};
+
+/* Parse a format name, text or binary */
+static inline bool parse_format(const char *name, BbvFormat &format) {
+  if (!strcmp(name, "text")) {
+    format = FORMAT_TEXT;
+  } else if (!strcmp(name, "binary")) {
+    format = FORMAT_BINARY;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* Decimal digits of 0 to 99 */
+static const char kDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+/* Format value at out, which has room for U64_MAX_DIGITS chars */
+static inline size_t format_u64(char *out, uint64_t value) {
+  char digits[U64_MAX_DIGITS];
+  char *p = digits + U64_MAX_DIGITS;
+  /* two digits at a time, from the least significant ones */
+  while (value >= 100) {
+    p -= 2;
+    memcpy(p, kDigitPairs + value % 100 * 2, 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    p -= 2;
+    memcpy(p, kDigitPairs + value * 2, 2);
+  } else {
+    *--p = '0' + value;
+  }
+  size_t len = digits + U64_MAX_DIGITS - p;
+  memcpy(out, p, len);
+  return len;
+}
+
+/* Append " :<id>:<count>" of a BBV line to buf */
+static inline void append_bbv_entry(std::string &buf, uint64_t id,
+                                    uint64_t count) {
+  char entry[U64_MAX_DIGITS * 2 + 3];
+  char *p = entry;
+  *p++ = ' ';
+  *p++ = ':';
+  p += format_u64(p, id);
+  *p++ = ':';
+  p += format_u64(p, count);
+  buf.append(entry, p - entry);
+}
+
+/* Encode value as LEB128 at out, returns the number of bytes */
+static inline size_t encode_varint(char *out, uint64_t value) {
+  size_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = static_cast<char>(value);
+  return len;
+}
+
+static inline void append_varint(std::string &buf, uint64_t value) {
+  char bytes[VARINT_MAX_BYTES];
+  buf.append(bytes, encode_varint(bytes, value));
+}
+
+/* Encoder of intervals, entries must be added in ascending order of id */
+class IntervalEncoder {
+ public:
+  explicit IntervalEncoder(BbvFormat format) : format_(format), last_id_(0) {}
+
+  /* Header of the file, empty for text */
+  void begin_file(std::string &buf) const {
+    if (format_ == FORMAT_BINARY) buf.append(kBinaryHeader, BINARY_HEADER_SIZE);
+  }
+
+  void begin(std::string &buf, uint64_t index) {
+    if (format_ == FORMAT_BINARY) {
+      append_varint(buf, index);
+      last_id_ = 0;
+    } else {
+      buf.push_back('T');
+    }
+  }
+
+  void add(std::string &buf, uint64_t id, uint64_t count) {
+    if (format_ == FORMAT_BINARY) {
+      char entry[VARINT_MAX_BYTES * 2];
+      size_t len = encode_varint(entry, id - last_id_);
+      len += encode_varint(entry + len, count);
+      buf.append(entry, len);
+      last_id_ = id;
+    } else {
+      append_bbv_entry(buf, id, count);
+    }
+  }
+
+  void end(std::string &buf) {
+    if (format_ == FORMAT_BINARY) {
+      buf.push_back(0);
+    } else {
+      buf.push_back('\n');
+    }
+  }
+
+ private:
+  BbvFormat format_;
+  uint64_t last_id_;
+};
+
+#endif  // QPOINTS_FORMAT_H_
@@ -0,0 +1,51 @@
+/*
+ * Output files of the tools.
+ */
+
+#include "output.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <iostream>
+
+bool OutputFile::open(const std::string &file_name) {
+  CodecOptions options = {CODEC_NONE, CODEC_DEFAULT_LEVEL,
+                          Z_DEFAULT_STRATEGY, false, 1};
+  if (!codec_of_file(file_name, options.codec)) return false;
+  return open(file_name, options);
+}
+
+bool OutputFile::open(const std::string &file_name,
+                      const CodecOptions &options) {
+  file_name_ = file_name;
+  encoder_ = open_encoder(file_name == "-" ? "/dev/stdout" : file_name,
+                          options);
+  if (!encoder_) {
+    std::cerr << "Failed to open output file: " << file_name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool OutputFile::write(const void *data, size_t len) {
+  auto p = static_cast<const char *>(data);
+  for (size_t pos = 0; !failed_ && pos < len; pos += OUTPUT_FLUSH_SIZE) {
+    failed_ = !encoder_->write(p + pos,
+                               std::min<size_t>(OUTPUT_FLUSH_SIZE, len - pos));
+  }
+  return !failed_;
+}
+
+bool OutputFile::close() {
+  if (!encoder_) return false;
+  write(buf.data(), buf.size());
+  buf.clear();
+  failed_ = !encoder_->close() || failed_;
+  delete encoder_;
+  encoder_ = nullptr;
+  if (failed_) {
+    std::cerr << "Failed to write output file: " << file_name_ << std::endl;
+  }
+  return !failed_;
+}
@@ -0,0 +1,49 @@
+/*
+ * Output files of the tools, formatted into a buffer and written through
+ * an encoder in large chunks.
+ */
+
+#ifndef QPOINTS_OUTPUT_H_
+#define QPOINTS_OUTPUT_H_
+
+#include <stddef.h>
+
+#include <string>
+
+#include "codec.h"
+
+/* Size of formatted output written at once */
+#define OUTPUT_FLUSH_SIZE (1024 * 1024)
+
+class OutputFile {
+ public:
+  OutputFile() : encoder_(nullptr), failed_(false) {}
+  ~OutputFile() { delete encoder_; }
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  /* Open a file compressed by its suffix, "-" for the standard output */
+  bool open(const std::string &file_name);
+  /* Open a file compressed with the given options */
+  bool open(const std::string &file_name, const CodecOptions &options);
+  /* Write data in chunks of OUTPUT_FLUSH_SIZE */
+  bool write(const void *data, size_t len);
+  /* Write the buffer once it holds OUTPUT_FLUSH_SIZE */
+  bool flush() {
+    if (buf.size() < OUTPUT_FLUSH_SIZE) return !failed_;
+    bool ok = write(buf.data(), buf.size());
+    buf.clear();
+    return ok;
+  }
+  /* Write the rest of the buffer and close the file, reports failures */
+  bool close();
+
+  std::string buf; /* formatted output not written yet */
+
+ private:
+  Encoder *encoder_;
+  std::string file_name_;
+  bool failed_;
+};
+
+#endif  // QPOINTS_OUTPUT_H_
@@ -0,0 +1,110 @@
+/*
+ * Random projection of BBVs.
+ *
+ * Like SimPoint, vectors are projected to a few dimensions before
+ * clustering. Each block id maps to a row of weights uniformly distributed
+ * in [-1, 1), derived from a hash of the id, so every tool projects the
+ * same block the same way without sharing a matrix.
+ *
+ * Files of projected vectors start with an 8-byte header, the magic
+ * "QPPRJ" followed by the version, the number of dimensions and a zero
+ * byte. Each interval is then a record of
+ *
+ *   <interval index> <instructions> <float>...
+ *
+ * where the index and the number of instructions are LEB128 varints, and
+ * the vector normalized by the number of instructions follows as
+ * little-endian IEEE floats.
+ */
+
+#ifndef QPOINTS_PROJECTION_H_
+#define QPOINTS_PROJECTION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "format.h"
+
+/* Default number of dimensions and seed, the defaults of SimPoint */
+#define PROJECT_DIMS 15
+#define PROJECT_SEED 2042712918
+
+#define PROJECTED_VERSION 1
+#define PROJECTED_HEADER_SIZE 8
+#define PROJECTED_MAX_DIMS 255
+/* Ids whose rows are cached, sparse ids above are hashed on every use */
+#define PROJECT_MAX_CACHED_IDS (1 << 20)
+static const char kProjectedMagic[] = "QPPRJ";
+
+/* Weight of a block id in a dimension */
+static inline float project_weight(uint64_t seed, uint64_t id, unsigned dim) {
+  /* splitmix64 of the id and dimension */
+  uint64_t h = seed + id * 0x9e3779b97f4a7c15ull + dim;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  /* the top 24 bits are exact in a float */
+  return static_cast<float>(h >> 40) * (2.0f / (1 << 24)) - 1.0f;
+}
+
+/* Projection with the rows of blocks cached by id */
+class Projection {
+ public:
+  explicit Projection(unsigned dims = PROJECT_DIMS,
+                      uint64_t seed = PROJECT_SEED)
+      : dims_(dims), seed_(seed), sparse_row_(dims) {}
+
+  unsigned dims() const { return dims_; }
+
+  /* Weights of id, valid until the next call */
+  const float *row(uint64_t id) {
+    if (id >= PROJECT_MAX_CACHED_IDS) {
+      for (unsigned i = 0; i < dims_; ++i) {
+        sparse_row_[i] = project_weight(seed_, id, i);
+      }
+      return sparse_row_.data();
+    }
+    if (id >= rows_.size() / dims_) {
+      size_t old_size = rows_.size();
+      rows_.resize((id + 1) * dims_);
+      for (size_t i = old_size; i < rows_.size(); ++i) {
+        rows_[i] = project_weight(seed_, i / dims_, i % dims_);
+      }
+    }
+    return rows_.data() + id * dims_;
+  }
+
+  /* Add a projected entry to out, which has dims elements */
+  void add(double *out, uint64_t id, double value) {
+    auto w = row(id);
+    for (unsigned i = 0; i < dims_; ++i) out[i] += w[i] * value;
+  }
+
+ private:
+  unsigned dims_;
+  uint64_t seed_;
+  std::vector<float> rows_; /* indexed by id */
+  std::vector<float> sparse_row_;
+};
+
+static inline void append_projected_header(std::string &buf, unsigned dims) {
+  buf.append(kProjectedMagic, sizeof(kProjectedMagic) - 1);
+  buf.push_back(PROJECTED_VERSION);
+  buf.push_back(static_cast<char>(dims));
+  buf.push_back(0);
+}
+
+/* Append the record of an interval, only little-endian hosts are supported */
+static inline void append_projected(std::string &buf, uint64_t index,
+                                    uint64_t insns, const float *vec,
+                                    unsigned dims) {
+  static_assert(sizeof(float) == 4, "float is not 32-bit");
+  append_varint(buf, index);
+  append_varint(buf, insns);
+  buf.append(reinterpret_cast<const char *>(vec), sizeof(float) * dims);
+}
+
+#endif  // QPOINTS_PROJECTION_H_
@@ -0,0 +1,258 @@
+/*
+ * Readers of BBV files, in either text or binary format, of block traces
+ * and of block dictionaries.
+ */
+
+#include "reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "format.h"
+#include "projection.h"
+#include "trace.h"
+
+/* Size of the input buffer */
+#define READER_BUF_SIZE (256 * 1024)
+
+InputFile::InputFile()
+    : file_(nullptr), buf_(READER_BUF_SIZE), pos_(0), end_(0), failed_(false) {}
+
+InputFile::~InputFile() {
+  if (file_) gzclose(file_);
+}
+
+bool InputFile::open(const std::string &file_name) {
+  file_name_ = file_name;
+  if (file_name == "-") {
+    file_ = gzdopen(dup(STDIN_FILENO), "rb");
+  } else {
+    file_ = gzopen(file_name.c_str(), "rb");
+  }
+  if (!file_) return fail("failed to open");
+  gzbuffer(file_, READER_BUF_SIZE);
+  return true;
+}
+
+bool InputFile::match_header(const char *header, size_t len) {
+  while (end_ < len && refill()) {
+  }
+  if (end_ < len || memcmp(buf_.data(), header, len)) return false;
+  pos_ = len;
+  return true;
+}
+
+/* append more input to the buffer, compacting it first */
+bool InputFile::refill() {
+  if (failed_ || !file_) return false;
+  if (pos_) {
+    memmove(buf_.data(), buf_.data() + pos_, end_ - pos_);
+    end_ -= pos_;
+    pos_ = 0;
+  }
+  int len = gzread(file_, buf_.data() + end_, buf_.size() - end_);
+  if (len < 0) return fail("failed to read");
+  end_ += len;
+  return len > 0;
+}
+
+bool InputFile::read_varint(uint64_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = get();
+    if (c < 0) return false;
+    value |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return fail("invalid varint");
+}
+
+bool InputFile::fail(const char *message) {
+  if (!failed_) {
+    std::cerr << file_name_ << ": " << message << std::endl;
+    failed_ = true;
+  }
+  return false;
+}
+
+bool BbvReader::open(const std::string &file_name) {
+  if (!in_.open(file_name)) return false;
+
+  /* detect the binary header, text is left in the buffer */
+  if (in_.match_header(kBinaryHeader, BINARY_HEADER_SIZE - 3)) {
+    if (in_.get() != BINARY_VERSION) {
+      return in_.fail("unsupported binary version");
+    }
+    in_.get();
+    in_.get();
+    binary_ = true;
+  } else if (in_.match_header(kProjectedMagic, sizeof(kProjectedMagic) - 1)) {
+    if (in_.get() != PROJECTED_VERSION) {
+      return in_.fail("unsupported projected version");
+    }
+    int dims = in_.get();
+    if (dims <= 0 || in_.get() < 0) return in_.fail("invalid header");
+    binary_ = true;
+    dims_ = dims;
+  }
+  return !in_.failed();
+}
+
+bool BbvReader::next(BbvInterval &interval) {
+  interval.entries.clear();
+  if (in_.failed()) return false;
+  if (dims_) return next_projected(interval);
+  return binary_ ? next_binary(interval) : next_text(interval);
+}
+
+bool BbvReader::read_number(uint64_t &value) {
+  int c = in_.peek();
+  if (c < '0' || c > '9') return in_.fail("expected a number");
+  value = 0;
+  while ((c = in_.peek()) >= '0' && c <= '9') {
+    value = value * 10 + (c - '0');
+    in_.skip();
+  }
+  return true;
+}
+
+bool BbvReader::next_binary(BbvInterval &interval) {
+  /* a clean end of file may only happen between records */
+  if (!in_.read_varint(interval.index)) return false;
+  uint64_t id = 0, delta, count;
+  for (;;) {
+    if (!in_.read_varint(delta)) return in_.fail("truncated interval");
+    if (!delta) break;
+    if (!in_.read_varint(count)) return in_.fail("truncated interval");
+    id += delta;
+    interval.entries.push_back({id, count});
+  }
+  next_index_ = interval.index + 1;
+  return true;
+}
+
+bool BbvReader::next_text(BbvInterval &interval) {
+  int c;
+  while ((c = in_.get()) == '\n' || c == '\r') {
+  }
+  if (c < 0) return false;
+  if (c != 'T') return in_.fail("expected 'T' at the beginning of a line");
+
+  for (;;) {
+    while ((c = in_.peek()) == ' ' || c == '\t' || c == '\r') in_.skip();
+    if (c < 0 || c == '\n') break;
+    BbvEntry entry;
+    if (in_.get() != ':' || !read_number(entry.id) || in_.get() != ':' ||
+        !read_number(entry.count)) {
+      return in_.fail("invalid entry");
+    }
+    interval.entries.push_back(entry);
+  }
+  interval.index = next_index_++;
+  return true;
+}
+
+bool BbvReader::next_projected(BbvInterval &interval) {
+  if (!in_.read_varint(interval.index)) return false;
+  if (!in_.read_varint(interval.insns)) return in_.fail("truncated vector");
+  interval.projected.resize(dims_);
+  auto bytes = reinterpret_cast<unsigned char *>(interval.projected.data());
+  for (size_t i = 0; i < sizeof(float) * dims_; ++i) {
+    int c = in_.get();
+    if (c < 0) return in_.fail("truncated vector");
+    bytes[i] = c;
+  }
+  next_index_ = interval.index + 1;
+  return true;
+}
+
+bool TraceReader::open(const std::string &file_name) {
+  if (!in_.open(file_name)) return false;
+  if (!in_.match_header(kTraceHeader, TRACE_HEADER_SIZE)) {
+    return in_.fail("not a block trace of a supported version");
+  }
+  return true;
+}
+
+bool TraceReader::next(TraceRecord &record) {
+  if (in_.failed()) return false;
+  for (;;) {
+    uint64_t value;
+    /* a clean end of file may only happen between records */
+    if (!in_.read_varint(value)) return false;
+    uint64_t arg = value >> 2;
+    if (vcpu_ >= last_ids_.size()) last_ids_.resize(vcpu_ + 1);
+    auto &last_id = last_ids_[vcpu_];
+
+    record.kind = value & 3;
+    record.vcpu = vcpu_;
+    switch (record.kind) {
+      case TRACE_BLOCK:
+        last_id += zigzag_decode(arg);
+        record.id = last_id;
+        record.count = 1;
+        return true;
+      case TRACE_REPEAT:
+        if (!last_id) return in_.fail("repeat without a block");
+        record.kind = TRACE_BLOCK;
+        record.id = last_id;
+        record.count = arg;
+        return true;
+      case TRACE_DEFINE:
+        record.id = arg;
+        if (!in_.read_varint(record.pc) || !in_.read_varint(record.insns)) {
+          return in_.fail("truncated block definition");
+        }
+        return true;
+      default:
+        if (arg == MARKER_CKPT) return true;
+        if (arg != MARKER_VCPU) return in_.fail("unknown marker");
+        if (!in_.read_varint(vcpu_)) return in_.fail("truncated marker");
+        if (vcpu_ >= TRACE_MAX_VCPUS) return in_.fail("invalid vCPU");
+        break;
+    }
+  }
+}
+
+/* Read a line without its newline, returns false at the end of the file */
+static bool read_line(InputFile &in, std::string &line) {
+  line.clear();
+  int c;
+  while ((c = in.get()) >= 0 && c != '\n') line.push_back(c);
+  return c >= 0 || !line.empty();
+}
+
+bool read_blocks(const std::string &file_name, uint64_t &first_interval,
+                 std::vector<BlockDef> &blocks) {
+  InputFile in;
+  if (!in.open(file_name)) return false;
+  if (!in.match_header(kBlocksMagic, sizeof(kBlocksMagic) - 1)) {
+    return in.fail("not a block dictionary");
+  }
+  std::string line;
+  char *p;
+  read_line(in, line);
+  if (strtoull(line.c_str(), &p, 10) != BLOCKS_VERSION) {
+    return in.fail("unsupported block dictionary version");
+  }
+  first_interval = strtoull(p, &p, 10);
+  if (*p != '\0') return in.fail("invalid header");
+
+  uint64_t last_id = 0;
+  while (read_line(in, line)) {
+    BlockDef def;
+    def.id = strtoull(line.c_str(), &p, 10);
+    def.pc = strtoull(p, &p, 16);
+    def.insns = strtoull(p, &p, 10);
+    if (*p != '\0' || def.id <= last_id || !def.insns) {
+      return in.fail("invalid block");
+    }
+    last_id = def.id;
+    blocks.push_back(def);
+  }
+  return !in.failed();
+}
@@ -0,0 +1,142 @@
+/*
+ * Readers of BBV files, in either text or binary format, of block traces
+ * and of block dictionaries.
+ */
+
+#ifndef QPOINTS_READER_H_
+#define QPOINTS_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+
+#include "blocks.h"
+
+/* Buffered input from a plain or gzipped file */
+class InputFile {
+ public:
+  InputFile();
+  ~InputFile();
+  InputFile(const InputFile &) = delete;
+  InputFile &operator=(const InputFile &) = delete;
+
+  /* Open a plain or gzipped file, "-" for the standard input */
+  bool open(const std::string &file_name);
+
+  int get() {
+    if (pos_ == end_ && !refill()) return -1;
+    return buf_[pos_++];
+  }
+  int peek() {
+    if (pos_ == end_ && !refill()) return -1;
+    return buf_[pos_];
+  }
+  void skip() { pos_++; }
+  /*
+   * Whether the input starts with the given header, consumed if it does.
+   * Only valid right after open.
+   */
+  bool match_header(const char *header, size_t len);
+  bool read_varint(uint64_t &value);
+  /* Report an error once, always returns false */
+  bool fail(const char *message);
+
+  bool failed() const { return failed_; }
+  const std::string &file_name() const { return file_name_; }
+
+ private:
+  bool refill();
+
+  std::string file_name_;
+  gzFile file_;
+  std::vector<unsigned char> buf_;
+  size_t pos_, end_;
+  bool failed_;
+};
+
+struct BbvEntry {
+  uint64_t id;
+  uint64_t count;
+};
+
+struct BbvInterval {
+  uint64_t index;
+  std::vector<BbvEntry> entries;
+  /* instructions and the vector of projected files, without entries */
+  uint64_t insns;
+  std::vector<float> projected;
+};
+
+class BbvReader {
+ public:
+  BbvReader() : binary_(false), dims_(0), next_index_(0) {}
+
+  /*
+   * Open a plain or gzipped file, "-" for the standard input.
+   * The format is detected from the header, either BBVs or projected
+   * vectors.
+   */
+  bool open(const std::string &file_name);
+  /* Read the next interval, returns false at the end or on error */
+  bool next(BbvInterval &interval);
+
+  bool binary() const { return binary_; }
+  /* Dimensions of projected vectors, 0 for BBVs */
+  unsigned dims() const { return dims_; }
+  /* Whether reading stopped because of an I/O or format error */
+  bool failed() const { return in_.failed(); }
+  const std::string &file_name() const { return in_.file_name(); }
+
+ private:
+  bool read_number(uint64_t &value);
+  bool next_binary(BbvInterval &interval);
+  bool next_text(BbvInterval &interval);
+  bool next_projected(BbvInterval &interval);
+
+  InputFile in_;
+  bool binary_;
+  unsigned dims_;
+  uint64_t next_index_;
+};
+
+struct TraceRecord {
+  int kind;       /* TRACE_BLOCK, TRACE_DEFINE or TRACE_MARKER */
+  uint64_t vcpu;  /* vCPU of blocks and checkpoints */
+  uint64_t id;    /* id of the block */
+  uint64_t count; /* consecutive executions of the block */
+  uint64_t pc;    /* start address of a defined block */
+  uint64_t insns; /* instructions of a defined block */
+};
+
+/* Reader of block traces, see trace.h for the format */
+class TraceReader {
+ public:
+  TraceReader() : vcpu_(0) {}
+
+  bool open(const std::string &file_name);
+  /*
+   * Read the next record, returns false at the end or on error. Repeats
+   * of a block are returned as its block record with the count of repeats.
+   */
+  bool next(TraceRecord &record);
+
+  bool failed() const { return in_.failed(); }
+  const std::string &file_name() const { return in_.file_name(); }
+
+ private:
+  InputFile in_;
+  uint64_t vcpu_;
+  std::vector<uint64_t> last_ids_; /* indexed by vCPU */
+};
+
+/*
+ * Read a block dictionary, see blocks.h for the format, with the index of
+ * the first interval of its BBV file
+ */
+bool read_blocks(const std::string &file_name, uint64_t &first_interval,
+                 std::vector<BlockDef> &blocks);
+
+#endif  // QPOINTS_READER_H_
@@ -0,0 +1,114 @@
+/*
+ * Self-profiling statistics of the plugin.
+ *
+ * Statistics are only collected when built with STATS=1, otherwise the
+ * STAT_* macros expand to nothing, and the hot paths are unchanged. Counts
+ * are relaxed atomics, since callbacks of all vCPUs update them.
+ */
+
+#ifndef QPOINTS_STATS_H_
+#define QPOINTS_STATS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+
+#ifndef STATS
+#define STATS 0
+#endif
+
+enum Stat {
+  STAT_TB_RECORD,      /* translated TBs */
+  STAT_USER_TBS,       /* translated user TBs */
+  STAT_CKPT_TBS,       /* translated TBs of the checkpoint function */
+  STAT_CALLBACKS,      /* boundary callbacks of user and checkpoint TBs */
+  STAT_LOCKS,          /* acquisitions of the plugin lock */
+  STAT_LOCK_CONTENDED, /* acquisitions waiting for another thread */
+  STAT_LOCK_WAIT_NS,
+  STAT_DUMPS, /* intervals dumped */
+  STAT_DUMP_NS,
+  STAT_FORMAT_NS, /* collecting counters and formatting entries in dumps */
+  STAT_BLOCKS,    /* distinct blocks */
+  STAT_TABLE_SLOTS,
+  STAT_BYTES_WRITTEN, /* uncompressed bytes of all files */
+  STAT_WRITE_NS,      /* compressing and writing in writer threads */
+  STAT_WRITER_STALLS,
+  STAT_WRITER_STALL_NS,
+  STAT_MAX_QUEUE_DEPTH,
+  NUM_STATS,
+};
+
+static const char *const kStatNames[NUM_STATS] = {
+    "tb_record",     "user_tbs",       "ckpt_tbs",        "callbacks",
+    "locks",         "lock_contended", "lock_wait_ns",    "dumps",
+    "dump_ns",       "format_ns",      "blocks",          "table_slots",
+    "bytes_written", "write_ns",       "writer_stalls",   "writer_stall_ns",
+    "max_queue_depth",
+};
+
+static inline uint64_t stat_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#if STATS
+static std::atomic<uint64_t> plugin_stats[NUM_STATS];
+
+#define STAT_ADD(stat, n) \
+  plugin_stats[stat].fetch_add(n, std::memory_order_relaxed)
+#define STAT_INC(stat) STAT_ADD(stat, 1)
+#define STAT_SET(stat, n) plugin_stats[stat].store(n, std::memory_order_relaxed)
+#define STAT_MAX(stat, n)                                              \
+  do {                                                                 \
+    uint64_t value_ = (n);                                             \
+    if (plugin_stats[stat].load(std::memory_order_relaxed) < value_) { \
+      plugin_stats[stat].store(value_, std::memory_order_relaxed);     \
+    }                                                                  \
+  } while (0)
+/* Time from STAT_TIMER(var) to STAT_TIME(stat, var) */
+#define STAT_TIMER(var) uint64_t var = stat_now_ns()
+#define STAT_TIME(stat, var) STAT_ADD(stat, stat_now_ns() - var)
+
+/* Lock a mutex, counting and timing the waits for other threads */
+static inline void stat_lock(std::mutex &mutex) {
+  STAT_INC(STAT_LOCKS);
+  if (mutex.try_lock()) return;
+  STAT_INC(STAT_LOCK_CONTENDED);
+  STAT_TIMER(start);
+  mutex.lock();
+  STAT_TIME(STAT_LOCK_WAIT_NS, start);
+}
+
+/* Print all statistics, as a JSON object or one per line */
+static inline void print_stats(std::ostream &out, bool json) {
+  if (json) out << "{";
+  for (int i = 0; i < NUM_STATS; ++i) {
+    auto value = plugin_stats[i].load(std::memory_order_relaxed);
+    if (json) {
+      out << (i ? ", " : "") << "\"" << kStatNames[i] << "\": " << value;
+    } else {
+      out << "  " << kStatNames[i] << " " << value << "\n";
+    }
+  }
+  if (json) out << "}\n";
+}
+#else
+#define STAT_ADD(stat, n) \
+  do {                    \
+  } while (0)
+#define STAT_INC(stat) STAT_ADD(stat, 1)
+#define STAT_SET(stat, n) STAT_ADD(stat, n)
+#define STAT_MAX(stat, n) STAT_ADD(stat, n)
+#define STAT_TIMER(var) \
+  do {                  \
+  } while (0)
+#define STAT_TIME(stat, var) STAT_ADD(stat, 0)
+
+static inline void stat_lock(std::mutex &mutex) { mutex.lock(); }
+#endif
+
+#endif  // QPOINTS_STATS_H_
@@ -0,0 +1,110 @@
+/*
+ * Encoding of block traces.
+ *
+ * A trace records every executed user TB, so BBVs can be rebuilt offline
+ * with other intervals, filters or ids. It starts with an 8-byte header,
+ * the magic "QPTRC" followed by the version and two zero bytes, and then
+ * a sequence of records. The first LEB128 varint of each record holds the
+ * kind of the record in its low 2 bits and an argument in the others:
+ *
+ *   block   zigzag encoded difference from the id of the last block
+ *   repeat  number of extra consecutive executions of the last block
+ *   define  id of a new block, followed by varints of its pc and insns
+ *   marker  MARKER_CKPT for a checkpoint, or MARKER_VCPU followed by a
+ *           varint of the vCPU that the following records belong to
+ *
+ * Blocks, repeats and checkpoints belong to a vCPU, and the last block is
+ * tracked per vCPU, starting from zero. The plugin writes the records of
+ * every vCPU at each interval boundary, so they precede the boundary in
+ * the trace. This is exact for a single vCPU, while under SMP blocks that
+ * run on other vCPUs during the boundary may end up on either side. A block is always defined before
+ * it is executed. Tight loops collapse into repeats and nearby blocks
+ * into small deltas, which leaves a lot of redundancy for the codec.
+ */
+
+#ifndef QPOINTS_TRACE_H_
+#define QPOINTS_TRACE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "format.h"
+
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 8
+static const char kTraceHeader[TRACE_HEADER_SIZE] = {
+    'Q', 'P', 'T', 'R', 'C', TRACE_VERSION, 0, 0};
+
+/* Upper bound of vCPU indices */
+#define TRACE_MAX_VCPUS 1024
+
+/* Kinds of records */
+#define TRACE_BLOCK 0
+#define TRACE_REPEAT 1
+#define TRACE_DEFINE 2
+#define TRACE_MARKER 3
+
+/* Kinds of markers */
+#define MARKER_CKPT 0
+#define MARKER_VCPU 1
+
+static inline uint64_t zigzag_encode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ (value >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static inline void append_trace_record(std::string &buf, int kind,
+                                       uint64_t arg) {
+  append_varint(buf, arg << 2 | kind);
+}
+
+static inline void append_trace_define(std::string &buf, uint64_t id,
+                                       uint64_t pc, uint64_t insns) {
+  append_trace_record(buf, TRACE_DEFINE, id);
+  append_varint(buf, pc);
+  append_varint(buf, insns);
+}
+
+static inline void append_trace_vcpu(std::string &buf, uint64_t vcpu) {
+  append_trace_record(buf, TRACE_MARKER, MARKER_VCPU);
+  append_varint(buf, vcpu);
+}
+
+/* Encoder of the blocks executed by a vCPU */
+class TraceEncoder {
+ public:
+  TraceEncoder() : last_id_(0), repeats_(0) {}
+
+  void block(std::string &buf, uint64_t id) {
+    if (id == last_id_) {
+      ++repeats_;
+      return;
+    }
+    flush(buf);
+    append_trace_record(buf, TRACE_BLOCK, zigzag_encode(id - last_id_));
+    last_id_ = id;
+  }
+
+  void checkpoint(std::string &buf) {
+    flush(buf);
+    append_trace_record(buf, TRACE_MARKER, MARKER_CKPT);
+  }
+
+  /* Write pending repeats */
+  void flush(std::string &buf) {
+    if (repeats_) {
+      append_trace_record(buf, TRACE_REPEAT, repeats_);
+      repeats_ = 0;
+    }
+  }
+
+ private:
+  uint64_t last_id_;
+  uint64_t repeats_;
+};
+
+#endif  // QPOINTS_TRACE_H_
@@ -0,0 +1,73 @@
+/*
+ * Asynchronous writer of BBV files.
+ */
+
+#include "writer.h"
+
+#include <chrono>
+
+BbvWriter::BbvWriter(Encoder *encoder, const std::string &file_name)
+    : encoder_(encoder),
+      file_name_(file_name),
+      failed_(false),
+      closing_(false),
+      stats_({0, 0, 0, 0, 0}) {
+  for (auto &buf : buffers_) free_.push(&buf);
+  thread_ = std::thread(&BbvWriter::run, this);
+}
+
+std::string *BbvWriter::get_buffer() {
+  std::string *buf;
+  if (!free_.pop(buf)) {
+    auto start = std::chrono::steady_clock::now();
+    while (!free_.pop(buf)) std::this_thread::yield();
+    auto stall = std::chrono::steady_clock::now() - start;
+    stats_.stalls++;
+    stats_.stall_ns +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(stall).count();
+  }
+  buf->clear();
+  return buf;
+}
+
+void BbvWriter::put_buffer(std::string *buf) {
+  full_.push(buf);
+  auto depth = full_.size();
+  if (depth > stats_.max_queue_depth) stats_.max_queue_depth = depth;
+  cond_.notify_one();
+}
+
+bool BbvWriter::close() {
+  closing_.store(true, std::memory_order_release);
+  cond_.notify_one();
+  thread_.join();
+  bool ok = encoder_->close() && !failed_;
+  delete encoder_;
+  return ok;
+}
+
+void BbvWriter::run() {
+  if (output_thread_hook) output_thread_hook();
+  for (;;) {
+    /* everything queued before close is visible once closing is seen */
+    bool closing = closing_.load(std::memory_order_acquire);
+    std::string *buf;
+    while (full_.pop(buf)) {
+      auto start = std::chrono::steady_clock::now();
+      if (!encoder_->write(buf->data(), buf->size())) failed_ = true;
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      stats_.bytes += buf->size();
+      stats_.write_ns +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count();
+      free_.push(buf);
+    }
+    if (closing) break;
+
+    /* a missed notification only delays the writer by the timeout */
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait_for(lock, std::chrono::milliseconds(1), [this] {
+      return full_.size() || closing_.load(std::memory_order_acquire);
+    });
+  }
+}
@@ -0,0 +1,103 @@
+/*
+ * Asynchronous writer of BBV files.
+ *
+ * Intervals are formatted into buffers taken from a fixed pool, and handed
+ * to a writer thread through a bounded lock-free queue. Compression and
+ * file I/O then overlap with emulation, and the producer only stalls when
+ * every buffer is still waiting to be written.
+ */
+
+#ifndef QPOINTS_WRITER_H_
+#define QPOINTS_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "codec.h"
+
+/* Number of buffers in flight between the producer and the writer */
+#define WRITER_QUEUE_LEN 8
+
+/* Bounded single-producer single-consumer queue */
+template <typename T, size_t N>
+class SpscQueue {
+ public:
+  bool push(T value) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == N) return false;
+    items_[tail % N] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value) {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    value = items_[head % N];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+
+ private:
+  /* keep the indices in separate cache lines */
+  T items_[N];
+  std::atomic<size_t> head_{0};
+  char padding_[64 - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> tail_{0};
+};
+
+struct WriterStats {
+  size_t max_queue_depth;
+  uint64_t stalls;
+  uint64_t stall_ns;
+  uint64_t bytes;    /* written by the writer thread, before compression */
+  uint64_t write_ns; /* spent by the writer thread in the encoder */
+};
+
+class BbvWriter {
+ public:
+  /* Takes the ownership of the encoder of the file */
+  BbvWriter(Encoder *encoder, const std::string &file_name);
+  BbvWriter(const BbvWriter &) = delete;
+  BbvWriter &operator=(const BbvWriter &) = delete;
+
+  /* Take an empty buffer, waits if all buffers are in the queue */
+  std::string *get_buffer();
+  /* Queue a buffer taken by get_buffer for writing */
+  void put_buffer(std::string *buf);
+  /*
+   * Write all queued buffers, stop the writer thread and close the file.
+   * Returns false if anything failed to be written.
+   */
+  bool close();
+
+  const WriterStats &stats() const { return stats_; }
+  const std::string &file_name() const { return file_name_; }
+
+ private:
+  void run();
+
+  Encoder *encoder_;
+  std::string file_name_;
+  bool failed_;
+  std::string buffers_[WRITER_QUEUE_LEN];
+  SpscQueue<std::string *, WRITER_QUEUE_LEN> free_, full_;
+  std::atomic<bool> closing_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::thread thread_;
+  WriterStats stats_;
+};
+
+#endif  // QPOINTS_WRITER_H_